@@ -26,9 +26,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
 #include <libconfig.h>
 #include <math.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "config.h"
+#include "mobility_trace.h"
 
 static const double FREQ_CH1 = 2.412e9; // [Hz]
 static const double SPEED_LIGHT = 2.99792458e8; // [meter/sec]
@@ -89,6 +95,11 @@ enum model_sett {
 	MODEL_ISNODEAPS,
 	MODEL_MODEL_NAME,
 	MODEL_MODEL_PARAMETERS,
+	MODEL_SPATIAL_GRID,
+	MODEL_COMPACT_MATRIX,
+	MODEL_LAZY_LINKS,
+	MODEL_MOBILITY_TRACE,
+	MODEL_MOBILITY_TRACE_FORMAT,
 	__MODEL_SETTING_SIZE
 };
 static const char * const model_sett_str[] = {
@@ -106,15 +117,74 @@ static const char * const model_sett_str[] = {
 	"antenna_gain",
 	"isnodeaps",
 	"model_name",
-	"model_params"
+	"model_params",
+	"spatial_grid",
+	"compact_matrix",
+	"lazy_links",
+	"mobility_trace",
+	"mobility_trace_format"
+};
+
+// values of model.mobility_trace_format, by enum mobility_trace_format
+static const char * const mobility_trace_format_str[] = {
+	"auto",
+	"ns2",
+	"bonnmotion",
+	"binary"
 };
 
 enum { CONFIGURE_POSITIONS, CONFIGURE_DIRECTIONS };
 
+// the destination of configure_links()
+enum links_format {
+	LINKS_MATRIX,		// int or double
+	LINKS_MATRIX_COMPACT,	// s16 or u16, see model.compact_matrix
+	LINKS_LIST,		// struct snr_link, MODEL_SNR only
+};
+
+// a member of model.links, see configure_links()
+struct snr_link {
+	unsigned int	tx, rx;
+	int		snr;
+	unsigned int	order;	// in model.links
+};
+
+/* Error probabilities of model.compact_matrix are fixed point numbers with
+PROB_FIXED_SHIFT fractional bits, as custom_floating_point_to_fixed_point() in
+yserver_messages.c but in 16 bits. 1.0 is 1 << PROB_FIXED_SHIFT. */
+#define PROB_FIXED_SHIFT	15
+
+static inline u16 prob_to_fixed(double prob)
+{
+	return (u16) lround(prob * (1 << PROB_FIXED_SHIFT));
+}
+
+static inline double prob_from_fixed(u16 fixed)
+{
+	return (double) fixed / (1 << PROB_FIXED_SHIFT);
+}
+
+/* The SNRs of model.compact_matrix, clamped far beyond any radio. */
+static inline s16 snr_to_s16(int snr)
+{
+	if (snr < INT16_MIN)
+		return INT16_MIN;
+	if (snr > INT16_MAX)
+		return INT16_MAX;
+	return (s16) snr;
+}
 
 static char *config_setting_path(config_setting_t *setting);
 static unsigned int config_setting_length2(config_setting_t *setting);
+static bool configure_simulation(config_setting_t *simulation,
+				 struct yawmd *ctx);
 static bool configure_medium(config_setting_t *medium, struct medium *info);
+static bool configure_overload(config_setting_t *overload,
+			       struct medium *info);
+static bool configure_phy(config_setting_t *phy, struct medium *info);
+static void init_phy_timing(struct phy_timing *phy);
+static unsigned int link_cache_size(const struct yawmd *ctx,
+				    const struct medium *info);
 static bool configure_model(config_setting_t *model, struct medium *info);
 static bool configure_model_snr(config_setting_t *model,
 			       struct medium *info, bool *setting_present);
@@ -125,10 +195,17 @@ static bool configure_model_path_loss(config_setting_t *model,
 			             struct medium *info,
 			             bool *setting_present);
 static bool configure_links(config_setting_t *links, void *value_matrix,
-			    unsigned n_interfaces, int model_type);
+			    unsigned n_interfaces, int model_type,
+			    enum links_format format);
+static bool configure_model_bool(config_setting_t *model,
+				 bool *setting_present, enum model_sett sett,
+				 bool dflt, bool *val);
 static bool configure_positions_directions(config_setting_t *list,
 					   struct medium *info,
 					   int pos_dir);
+static bool configure_mobility_trace(config_setting_t *model,
+				     struct medium *info,
+				     bool *setting_present);
 static bool configure_model_type(config_setting_t *name,
 				 config_setting_t *params,
 				 struct medium *info);
@@ -141,23 +218,35 @@ static void print_matrix_double(double *matrix, unsigned int rows,
 //static void dump_medium_info(struct medium* info);
 static struct medium* new_medium_info(void);
 static void delete_medium_info(struct medium *mi);
-static void medium_init_qos_queues(struct medium *medium);
-static void wqueue_init(struct wqueue *wqueue, int cw_min, int cw_max);
 static int get_link_snr_default(struct medium *medium, struct interface *sender,
 				struct interface *receiver);
 static int get_link_snr_from_snr_matrix(struct medium *medium,
 					struct interface *sender,
 					struct interface *receiver);
+static int get_link_snr_from_snr_matrix16(struct medium *medium,
+					  struct interface *sender,
+					  struct interface *receiver);
+static int get_link_snr_from_snr_lists(struct medium *medium,
+				       struct interface *sender,
+				       struct interface *receiver);
 static double _get_error_prob_from_snr(struct medium *medium, double snr,
 				       unsigned int rate_idx, u32 freq,
 				       int frame_len, struct interface *src,
 				       struct interface *dst);
+static void _get_error_prob_batch_from_snr(struct medium *medium,
+					   const int *snr, unsigned int n,
+					   unsigned int rate_idx, u32 freq,
+					   int frame_len, double *prob);
 static double get_error_prob_from_matrix(struct medium *medium, double snr,
 					 unsigned int rate_idx, u32 freq,
 					 int frame_len, struct interface *src,
 					 struct interface *dst);
-static void recalc_path_loss(struct medium *medium);
+static double get_error_prob_from_matrix16(struct medium *medium, double snr,
+					   unsigned int rate_idx, u32 freq,
+					   int frame_len, struct interface *src,
+					   struct interface *dst);
 static void move_interfaces(struct medium *medium);
+static void move_interfaces_trace(struct medium *medium);
 static int calc_path_loss_free_space(struct medium *medium,
 				     struct interface *src,
 				     struct interface *dst);
@@ -172,9 +261,41 @@ static int calc_path_loss_log_normal_shadowing(struct medium *medium,
 static int calc_path_loss_two_ray_ground(struct medium *medium,
 					 struct interface *src,
 					 struct interface *dst);
-
-extern double get_error_prob_from_snr(double snr, unsigned int rate_idx,
-				      u32 freq, int frame_len);
+static void path_loss_row_free_space(struct medium *medium, unsigned int src,
+				     const unsigned int *cols,
+				     unsigned int n_cols, double *dist,
+				     int *path_loss);
+static void path_loss_row_log_distance(struct medium *medium, unsigned int src,
+				       const unsigned int *cols,
+				       unsigned int n_cols, double *dist,
+				       int *path_loss);
+static void path_loss_row_itu(struct medium *medium, unsigned int src,
+			      const unsigned int *cols, unsigned int n_cols,
+			      double *dist, int *path_loss);
+static void path_loss_row_log_normal_shadowing(struct medium *medium,
+					       unsigned int src,
+					       const unsigned int *cols,
+					       unsigned int n_cols,
+					       double *dist, int *path_loss);
+static void path_loss_row_two_ray_ground(struct medium *medium,
+					 unsigned int src,
+					 const unsigned int *cols,
+					 unsigned int n_cols, double *dist,
+					 int *path_loss);
+static bool init_itf_arrays(struct medium *medium);
+static bool use_snr_lists(unsigned int n, size_t links);
+static bool snr_unheard(struct medium *medium, int snr);
+static struct snr_lists *snr_lists_new(unsigned int n, int absent_snr,
+				       bool absent_unheard);
+static bool snr_lists_from_links(struct snr_lists *lists, unsigned int n,
+				 struct snr_link *links, unsigned int n_links);
+static bool path_loss_uses_snr_lists(struct medium *medium);
+static bool init_lazy_links(struct medium *medium);
+static int get_link_snr_lazy(struct medium *medium, struct interface *sender,
+			     struct interface *receiver);
+
+extern double get_error_prob_from_snr(double snr, u32 rate, u32 freq,
+				      int frame_len);
 
 /**
  * @brief Compare two mac addresses.
@@ -245,6 +366,16 @@ static bool check_id_mac_addr_repetitions(struct yawmd *mediums,
 	return false;
 }
 
+/* Seed of the runs without simulation.seed. */
+static u64 seed_from_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (u64) now.tv_sec * 1000000000ULL ^ (u64) now.tv_nsec ^
+	       (u64) getpid() << 32;
+}
+
 /**
  * @brief Configure yawmd according to the parameter file.
  * 
@@ -255,10 +386,24 @@ static bool check_id_mac_addr_repetitions(struct yawmd *mediums,
 bool configure(char *file_name, struct yawmd *ctx)
 {
 	config_t cfg;
-	config_setting_t *root = NULL, *medium = NULL;
+	config_setting_t *root = NULL, *medium = NULL, *simulation = NULL;
+	struct rng streams;
 
 	config_init(&cfg);
 
+	ctx->time_dilation = CFG_DEFAULT_TIME_DILATION;
+	ctx->time_dilation_file = NULL;
+	ctx->mclock.tick = CFG_DEFAULT_MOBILITY_TICK;
+	ctx->mclock.start_delay = CFG_DEFAULT_MOBILITY_START_DELAY;
+	ctx->per_cache_bucket = CFG_DEFAULT_PER_CACHE_BUCKET;
+	ctx->link_cache = CFG_DEFAULT_LINK_CACHE;
+	ctx->per_file = NULL;
+	ctx->geometric_retries = CFG_DEFAULT_GEOMETRIC_RETRIES;
+	ctx->seed = seed_from_clock();
+	ctx->path_loss_threads = CFG_DEFAULT_PATH_LOSS_THREADS;
+	ctx->path_loss_schedule = POOL_STATIC;
+	ctx->path_loss_pool = NULL;
+
 	// report errors in the file sintax
 	if (!config_read_file(&cfg, file_name)) {
 		fprintf(stderr, "%s:%d - %s\n", config_error_file(&cfg),
@@ -274,6 +419,8 @@ bool configure(char *file_name, struct yawmd *ctx)
 		char *s_name = config_setting_name(s);
 		if (strcmp(s_name, "medium") == 0) {
 			medium = s;
+		} else if (strcmp(s_name, "simulation") == 0) {
+			simulation = s;
 		} else {
 			fprintf(stdout,
 				"Ignoring unknown setting \"%s\" "
@@ -287,6 +434,16 @@ bool configure(char *file_name, struct yawmd *ctx)
 			config_setting_source_file(root));
 		goto exit_failure;
 	}
+	if (simulation != NULL && !configure_simulation(simulation, ctx))
+		goto exit_failure;
+	if (ctx->path_loss_threads > 0) {
+		ctx->path_loss_pool = pool_new(ctx->path_loss_threads,
+					       ctx->path_loss_schedule);
+		if (ctx->path_loss_pool == NULL)
+			fprintf(stderr, "Unable to start the path loss "
+				"threads, the path loss is calculated by the "
+				"mediums\n");
+	}
 	if (config_setting_type(medium) != CONFIG_TYPE_LIST) {
 		fprintf(stderr, "Setting \"medium\" (%s:%d) must be a list!\n",
 			config_setting_source_file(medium),
@@ -303,6 +460,7 @@ bool configure(char *file_name, struct yawmd *ctx)
 		goto exit_failure;
 	}
 
+	rng_seed(&streams, ctx->seed);
 	ctx->n_mediums = 0;
 	for (unsigned int i = 0; i < config_setting_length2(medium); i++) {
 		printf("medium[%d]:\n", i); // FIXME: REMOVE ?
@@ -319,6 +477,7 @@ bool configure(char *file_name, struct yawmd *ctx)
 
 		struct medium *info = new_medium_info();
 		list_add_tail(&(info->list), &(ctx->medium_list));
+		info->ctx = ctx;
 		if (!configure_medium(s, info)) {
 			fprintf(stdout, "Failure to configure medium.\n");
 			goto exit_mediums;
@@ -328,7 +487,13 @@ bool configure(char *file_name, struct yawmd *ctx)
 		if (check_id_mac_addr_repetitions(ctx, info))
 			goto exit_mediums;
 		
-		info->ctx = ctx;
+		init_phy_timing(&info->phy);
+		// The n-th medium of the file draws from the n-th stream.
+		info->rng = streams;
+		rng_jump(&streams);
+		if (ctx->per_cache_bucket > 0)
+			info->per_cache = per_cache_new(ctx->per_cache_bucket);
+		info->link_cache_size = link_cache_size(ctx, info);
 		ctx->n_mediums++;
 		fprintf(stdout, "Medium configuration loaded successfully.\n");
 	}
@@ -341,10 +506,177 @@ bool configure(char *file_name, struct yawmd *ctx)
 exit_mediums:
 	delete_mediums(ctx);
 exit_failure:
+	pool_free(ctx->path_loss_pool);
+	ctx->path_loss_pool = NULL;
+	free(ctx->time_dilation_file);
+	ctx->time_dilation_file = NULL;
 	config_destroy(&cfg);
 	return false;
 }
 
+/**
+ * @brief Check and configure the optional group "simulation", with the settings
+ * common to all mediums.
+ * 
+ * @param simulation - the group "simulation"
+ * @param ctx
+ * @return true if the settings are valid
+ */
+static bool configure_simulation(config_setting_t *simulation,
+				 struct yawmd *ctx)
+{
+	if (!config_setting_is_group(simulation)) {
+		fprintf(stderr, setting_must_be_group,
+			config_setting_name(simulation),
+			config_setting_source_file(simulation),
+			config_setting_source_line(simulation));
+		return false;
+	}
+
+	for (unsigned int i = 0; i < config_setting_length2(simulation); i++) {
+		config_setting_t *e = config_setting_get_elem(simulation, i);
+		const char *name = config_setting_name(e);
+
+		if (strcmp(name, "time_dilation") == 0) {
+			if (config_setting_type(e) != CONFIG_TYPE_FLOAT) {
+				fprintf(stderr, setting_must_be_float, name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			ctx->time_dilation = config_setting_get_float(e);
+			if (ctx->time_dilation <= 0.0) {
+				fprintf(stderr,
+					"Setting \"%s\" (%s:%d) must be > 0.0.\n",
+					name, config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+		} else if (strcmp(name, "time_dilation_file") == 0) {
+			const char *file = config_setting_get_string(e);
+			if (file == NULL) {
+				fprintf(stderr, setting_must_be_string, name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			ctx->time_dilation_file = strdup(file);
+		} else if (strcmp(name, "per_file") == 0) {
+			const char *file = config_setting_get_string(e);
+			if (file == NULL) {
+				fprintf(stderr, setting_must_be_string, name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			ctx->per_file = strdup(file);
+		} else if (strcmp(name, "seed") == 0) {
+			if ((config_setting_type(e) != CONFIG_TYPE_INT &&
+			     config_setting_type(e) != CONFIG_TYPE_INT64) ||
+			    config_setting_get_int64(e) < 0) {
+				fprintf(stderr,
+					"Setting %s (%s:%u) must be an integer "
+					">= 0.\n", name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			ctx->seed = (u64) config_setting_get_int64(e);
+		} else if (strcmp(name, "geometric_retries") == 0) {
+			if (config_setting_type(e) != CONFIG_TYPE_BOOL) {
+				fprintf(stderr, setting_must_be_bool, name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			ctx->geometric_retries =
+				config_setting_get_bool(e) == CONFIG_TRUE;
+		} else if (strcmp(name, "per_cache_bucket") == 0) {
+			if (config_setting_type(e) != CONFIG_TYPE_INT ||
+			    config_setting_get_int(e) < 0) {
+				fprintf(stderr,
+					"Setting %s (%s:%u) must be an integer "
+					">= 0.\n", name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			ctx->per_cache_bucket =
+				(unsigned int) config_setting_get_int(e);
+		} else if (strcmp(name, "link_cache") == 0) {
+			if (config_setting_type(e) != CONFIG_TYPE_INT ||
+			    config_setting_get_int(e) < 0) {
+				fprintf(stderr,
+					"Setting %s (%s:%u) must be an integer "
+					">= 0.\n", name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			ctx->link_cache =
+				(unsigned int) config_setting_get_int(e);
+		} else if (strcmp(name, "path_loss_threads") == 0) {
+			if (config_setting_type(e) != CONFIG_TYPE_INT ||
+			    config_setting_get_int(e) < 0) {
+				fprintf(stderr,
+					"Setting %s (%s:%u) must be an integer "
+					">= 0.\n", name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			ctx->path_loss_threads =
+				(unsigned int) config_setting_get_int(e);
+		} else if (strcmp(name, "path_loss_schedule") == 0) {
+			const char *schedule = config_setting_get_string(e);
+			if (schedule == NULL) {
+				fprintf(stderr, setting_must_be_string, name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			if (strcmp(schedule, "static") == 0) {
+				ctx->path_loss_schedule = POOL_STATIC;
+			} else if (strcmp(schedule, "guided") == 0) {
+				ctx->path_loss_schedule = POOL_GUIDED;
+			} else {
+				fprintf(stderr, "Unknown value of %s = %s "
+					"(%s:%u).\n", name, schedule,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+		} else if (strcmp(name, "mobility_tick") == 0 ||
+			   strcmp(name, "mobility_start_delay") == 0) {
+			bool tick = strcmp(name, "mobility_tick") == 0;
+			if (config_setting_type(e) != CONFIG_TYPE_FLOAT) {
+				fprintf(stderr, setting_must_be_float, name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			double value = config_setting_get_float(e);
+			if (tick ? value <= 0.0 : value < 0.0) {
+				fprintf(stderr,
+					"Setting \"%s\" (%s:%d) must be %s 0.0.\n",
+					name, config_setting_source_file(e),
+					config_setting_source_line(e),
+					tick ? ">" : ">=");
+				return false;
+			}
+			if (tick)
+				ctx->mclock.tick = value;
+			else
+				ctx->mclock.start_delay = value;
+		} else {
+			fprintf(stdout, setting_ignore_unknown, name,
+				config_setting_source_file(e),
+				config_setting_source_line(e));
+		}
+	}
+	return true;
+}
+
 /**
  * @brief Check and configure one member of the list "medium" from the
  * configuration file.
@@ -370,6 +702,12 @@ static bool configure_medium(config_setting_t *medium, struct medium *info)
 			interfaces = true;
 		} else if (strcmp(name, "model") == 0) {
 			model = true;
+		} else if (strcmp(name, "overload") == 0) {
+			if (!configure_overload(e, info))
+				return false;
+		} else if (strcmp(name, "phy") == 0) {
+			if (!configure_phy(e, info))
+				return false;
 		} else {
 			fprintf(stdout,
 				"Ignoring unknown setting: \"%s\" (%s:%d).\n",
@@ -478,6 +816,152 @@ static bool configure_medium(config_setting_t *medium, struct medium *info)
 	return configure_model(mod, info);
 }
 
+static const char * const overload_policy_str[] = { "log",
+						   "drop_best_effort",
+						   "not_acked" };
+
+/**
+ * @brief Configure the optional group "overload" of a medium: the thresholds
+ * of lateness and queue depth and what to do when they are crossed.
+ * 
+ * @param overload - the group "overload"
+ * @param info
+ * @return true if the settings are valid
+ */
+static bool configure_overload(config_setting_t *overload, struct medium *info)
+{
+	if (!config_setting_is_group(overload)) {
+		fprintf(stderr, setting_must_be_group,
+			config_setting_name(overload),
+			config_setting_source_file(overload),
+			config_setting_source_line(overload));
+		return false;
+	}
+
+	for (unsigned int i = 0; i < config_setting_length2(overload); i++) {
+		config_setting_t *e = config_setting_get_elem(overload, i);
+		const char *name = config_setting_name(e);
+
+		if (strcmp(name, "max_lateness") == 0) {
+			if (config_setting_type(e) != CONFIG_TYPE_FLOAT) {
+				fprintf(stderr, setting_must_be_float, name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			double ms = config_setting_get_float(e);
+			if (ms < 0.0) {
+				fprintf(stderr,
+					"Setting \"%s\" (%s:%d) must be >= 0.0.\n",
+					name, config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			info->overload.max_lateness_usec = (long) (ms * 1000);
+		} else if (strcmp(name, "max_queue") == 0) {
+			if (config_setting_type(e) != CONFIG_TYPE_INT ||
+			    config_setting_get_int(e) < 0) {
+				fprintf(stderr,
+					"Setting %s (%s:%u) must be an integer "
+					">= 0.\n", name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			info->overload.max_queue =
+				(unsigned int) config_setting_get_int(e);
+		} else if (strcmp(name, "policy") == 0) {
+			const char *policy = config_setting_get_string(e);
+			unsigned int p;
+			if (policy == NULL) {
+				fprintf(stderr, setting_must_be_string, name,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			for (p = 0; p < 3; p++)
+				if (strcmp(policy, overload_policy_str[p]) == 0)
+					break;
+			if (p == 3) {
+				fprintf(stderr, "Unknown value of %s = %s "
+					"(%s:%u).\n", name, policy,
+					config_setting_source_file(e),
+					config_setting_source_line(e));
+				return false;
+			}
+			info->overload.policy = (enum overload_policy) p;
+		} else {
+			fprintf(stdout, setting_ignore_unknown, name,
+				config_setting_source_file(e),
+				config_setting_source_line(e));
+		}
+	}
+	return true;
+}
+
+static bool configure_phy(config_setting_t *phy, struct medium *info)
+{
+	if (!config_setting_is_group(phy)) {
+		fprintf(stderr, setting_must_be_group,
+			config_setting_name(phy),
+			config_setting_source_file(phy),
+			config_setting_source_line(phy));
+		return false;
+	}
+
+	for (unsigned int i = 0; i < config_setting_length2(phy); i++) {
+		config_setting_t *e = config_setting_get_elem(phy, i);
+		const char *name = config_setting_name(e);
+		int *value;
+
+		if (strcmp(name, "slot_time") == 0) {
+			value = &info->phy.slot_time;
+		} else if (strcmp(name, "sifs") == 0) {
+			value = &info->phy.sifs;
+		} else {
+			fprintf(stdout, setting_ignore_unknown, name,
+				config_setting_source_file(e),
+				config_setting_source_line(e));
+			continue;
+		}
+		if (config_setting_type(e) != CONFIG_TYPE_INT ||
+		    config_setting_get_int(e) <= 0) {
+			fprintf(stderr,
+				"Setting %s (%s:%u) must be an integer > 0.\n",
+				name, config_setting_source_file(e),
+				config_setting_source_line(e));
+			return false;
+		}
+		*value = config_setting_get_int(e);
+	}
+	return true;
+}
+
+/* The times derived from slot_time and SIFS. Needs the rate tables, see
+init_per_tables(). */
+static void init_phy_timing(struct phy_timing *phy)
+{
+	phy->difs = 2 * phy->slot_time + phy->sifs;
+	phy->ack_time[0] = rate_duration(0, 2412, 14) + phy->sifs;
+	phy->ack_time[1] = rate_duration(0, 5180, 14) + phy->sifs;
+}
+
+/* Slots of each row of medium.link_cache: simulation.link_cache rounded up to
+a power of 2, at most the first one >= n_interfaces. 0 when the SNR of each
+frame is random (fading) or already kept by lazy_links. */
+static unsigned int link_cache_size(const struct yawmd *ctx,
+				    const struct medium *info)
+{
+	unsigned int size = 1;
+
+	if (ctx->link_cache == 0 || info->fading_coefficient != 0 ||
+	    info->lazy_links)
+		return 0;
+	while (size < ctx->link_cache && size < info->n_interfaces)
+		size <<= 1;
+	return size;
+}
+
 static bool configure_model(config_setting_t *model, struct medium *info)
 {
 	bool set[__MODEL_SETTING_SIZE];
@@ -517,6 +1001,16 @@ static bool configure_model(config_setting_t *model, struct medium *info)
 			set[MODEL_MODEL_NAME] = true;
 		else if (strcmp(name, ms[MODEL_MODEL_PARAMETERS]) == 0)
 			set[MODEL_MODEL_PARAMETERS] = true;
+		else if (strcmp(name, ms[MODEL_SPATIAL_GRID]) == 0)
+			set[MODEL_SPATIAL_GRID] = true;
+		else if (strcmp(name, ms[MODEL_COMPACT_MATRIX]) == 0)
+			set[MODEL_COMPACT_MATRIX] = true;
+		else if (strcmp(name, ms[MODEL_LAZY_LINKS]) == 0)
+			set[MODEL_LAZY_LINKS] = true;
+		else if (strcmp(name, ms[MODEL_MOBILITY_TRACE]) == 0)
+			set[MODEL_MOBILITY_TRACE] = true;
+		else if (strcmp(name, ms[MODEL_MOBILITY_TRACE_FORMAT]) == 0)
+			set[MODEL_MOBILITY_TRACE_FORMAT] = true;
 		else
 			fprintf(stdout, setting_ignore_unknown, e->name,
 				config_setting_source_file(e),
@@ -572,8 +1066,11 @@ static char *model_ignore_message(const char *parent_path,
 	return msg;
 }
 
+/* Set the values of model.links in value_matrix, or with LINKS_LIST in the
+array of struct snr_link value_matrix, one per member. */
 static bool configure_links(config_setting_t *links, void *value_matrix,
-			    unsigned n_interfaces, int model_type)
+			    unsigned n_interfaces, int model_type,
+			    enum links_format format)
 {
 	for (unsigned int i = 0; i < config_setting_length2(links); i++) {
 		config_setting_t *el = config_setting_get_elem(links, i);
@@ -630,7 +1127,19 @@ static bool configure_links(config_setting_t *links, void *value_matrix,
 			return false;
 		}
 		
-		if (model_type == MODEL_SNR) {
+		if (model_type == MODEL_SNR && format == LINKS_LIST) {
+			struct snr_link *l = (struct snr_link *) value_matrix + i;
+			l->tx = source_interface;
+			l->rx = destination_interface;
+			l->snr = config_setting_get_int(value);
+			l->order = i;
+		} else if (model_type == MODEL_SNR &&
+			   format == LINKS_MATRIX_COMPACT) {
+			s16 *matrix = (s16 *) value_matrix;
+			matrix[source_interface * n_interfaces +
+			       destination_interface] =
+					snr_to_s16(config_setting_get_int(value));
+		} else if (model_type == MODEL_SNR) {
 			int *matrix = (int *) value_matrix;
 			matrix[source_interface * n_interfaces + 
 			       destination_interface] = 
@@ -645,6 +1154,13 @@ static bool configure_links(config_setting_t *links, void *value_matrix,
 				    config_setting_source_line(value));
 				return false;
 			}
+			if (format == LINKS_MATRIX_COMPACT) {
+				u16 *matrix = (u16 *) value_matrix;
+				matrix[source_interface * n_interfaces +
+				       destination_interface] =
+						prob_to_fixed(prob);
+				continue;
+			}
 			double *matrix = (double *) value_matrix;
 			matrix[source_interface * n_interfaces + 
 			       destination_interface] = prob;
@@ -653,6 +1169,28 @@ static bool configure_links(config_setting_t *links, void *value_matrix,
 	return true;
 }
 
+/* The bool model setting sett in *val, dflt if it is not set. */
+static bool configure_model_bool(config_setting_t *model,
+				 bool *setting_present, enum model_sett sett,
+				 bool dflt, bool *val)
+{
+	const char * const *ms = model_sett_str;
+	int v;
+
+	*val = dflt;
+	if (!setting_present[sett])
+		return true;
+	if (config_setting_lookup_bool(model, ms[sett], &v) == CONFIG_FALSE) {
+		config_setting_t *s = config_setting_lookup(model, ms[sett]);
+		fprintf(stderr, setting_must_be_bool, ms[sett],
+			config_setting_source_file(s),
+			config_setting_source_line(s));
+		return false;
+	}
+	*val = v == CONFIG_TRUE;
+	return true;
+}
+
 
 static bool configure_model_snr(config_setting_t *model, 
 			       struct medium *info,
@@ -690,6 +1228,14 @@ static bool configure_model_snr(config_setting_t *model,
 		fprintf(stdout, msg, ms[MODEL_MODEL_NAME]);
 	if (setting_present[MODEL_MODEL_PARAMETERS])
 		fprintf(stdout, msg, ms[MODEL_MODEL_PARAMETERS]);
+	if (setting_present[MODEL_SPATIAL_GRID])
+		fprintf(stdout, msg, ms[MODEL_SPATIAL_GRID]);
+	if (setting_present[MODEL_LAZY_LINKS])
+		fprintf(stdout, msg, ms[MODEL_LAZY_LINKS]);
+	if (setting_present[MODEL_MOBILITY_TRACE])
+		fprintf(stdout, msg, ms[MODEL_MOBILITY_TRACE]);
+	if (setting_present[MODEL_MOBILITY_TRACE_FORMAT])
+		fprintf(stdout, msg, ms[MODEL_MOBILITY_TRACE_FORMAT]);
 	free((void *)msg);
 
 	info->model_index = MN_SNR;
@@ -711,31 +1257,85 @@ static bool configure_model_snr(config_setting_t *model,
 		snr_default = config_setting_get_int(snr_d);
 	}
 
-	// if a failure happens it is freed when delete_medium_info() is called.
-	info->snr_matrix = malloc(sizeof(int) * 
-			   info->n_interfaces * info->n_interfaces);
-	for (unsigned int i = 0; i < info->n_interfaces; i++)
-		for (unsigned j = 0; j < info->n_interfaces; j++)
-			info->snr_matrix[i * info->n_interfaces + j] =
-				snr_default;
-	
+	bool compact;
+	if (!configure_model_bool(model, setting_present, MODEL_COMPACT_MATRIX,
+				  CFG_DEFAULT_COMPACT_MATRIX, &compact))
+		return false;
+
+	config_setting_t *links = NULL;
+	unsigned int n_links = 0;
 	if (setting_present[MODEL_LINKS]) {
-		config_setting_t *links =
-			config_setting_lookup(model, ms[MODEL_LINKS]);
+		links = config_setting_lookup(model, ms[MODEL_LINKS]);
 		if (config_setting_type(links) != CONFIG_TYPE_LIST) {
 			fprintf(stderr, setting_must_be_list, links->name);
 			return false;
 		}
-		if (!configure_links(links, (void *) info->snr_matrix,
-				     info->n_interfaces, MODEL_SNR)) {
+		n_links = config_setting_length2(links);
+	}
+
+	// if a failure happens it is freed when delete_medium_info() is called.
+	if (use_snr_lists(info->n_interfaces, n_links)) {
+		struct snr_link *list = calloc(n_links + 1,
+					       sizeof(struct snr_link));
+		bool ok;
+
+		info->snr_lists = snr_lists_new(info->n_interfaces,
+			snr_default, snr_unheard(info, snr_default));
+		if (list == NULL || info->snr_lists == NULL) {
+			free(list);
+			fprintf(stderr, "Out of memory for the SNRs of medium "
+				"%d\n", info->id);
+			return false;
+		}
+		ok = links == NULL ||
+		     (configure_links(links, (void *) list, info->n_interfaces,
+				      MODEL_SNR, LINKS_LIST) &&
+		      snr_lists_from_links(info->snr_lists, info->n_interfaces,
+					   list, n_links));
+		free(list);
+		if (!ok)
+			return false;
+		info->get_link_snr = get_link_snr_from_snr_lists;
+	} else if (compact) {
+		size_t n = (size_t) info->n_interfaces * info->n_interfaces;
+
+		info->compact_matrix = true;
+		info->snr_matrix16 = malloc(sizeof(s16) * n);
+		if (info->snr_matrix16 == NULL) {
+			fprintf(stderr, "Out of memory for the SNRs of medium "
+				"%d\n", info->id);
+			return false;
+		}
+		for (size_t k = 0; k < n; k++)
+			info->snr_matrix16[k] = snr_to_s16(snr_default);
+		if (links != NULL &&
+		    !configure_links(links, (void *) info->snr_matrix16,
+				     info->n_interfaces, MODEL_SNR,
+				     LINKS_MATRIX_COMPACT)) {
 			return false;
 		}
+		info->get_link_snr = get_link_snr_from_snr_matrix16;
+	} else {
+		info->snr_matrix = malloc(sizeof(int) * 
+				   info->n_interfaces * info->n_interfaces);
+		for (unsigned int i = 0; i < info->n_interfaces; i++)
+			for (unsigned j = 0; j < info->n_interfaces; j++)
+				info->snr_matrix[i * info->n_interfaces + j] =
+					snr_default;
+		if (links != NULL &&
+		    !configure_links(links, (void *) info->snr_matrix,
+				     info->n_interfaces, MODEL_SNR,
+				     LINKS_MATRIX)) {
+			return false;
+		}
+		info->get_link_snr = get_link_snr_from_snr_matrix;
 	}
 	fprintf(stdout, "%s = %d used for all unconfigured pairs in %s.\n",
 		ms[MODEL_DEFAULT_SNR], snr_default, ms[MODEL_LINKS]);
 	
-	info->get_link_snr = get_link_snr_from_snr_matrix;
+
 	info->get_error_prob = _get_error_prob_from_snr;
+	info->get_error_prob_batch = _get_error_prob_batch_from_snr;
 	info->move_interfaces = NULL;
 
 	return true;
@@ -777,6 +1377,14 @@ static bool configure_model_prob(config_setting_t *model,
 		fprintf(stdout, msg, ms[MODEL_MODEL_NAME]);
 	if (setting_present[MODEL_MODEL_PARAMETERS])
 		fprintf(stdout, msg, ms[MODEL_MODEL_PARAMETERS]);
+	if (setting_present[MODEL_SPATIAL_GRID])
+		fprintf(stdout, msg, ms[MODEL_SPATIAL_GRID]);
+	if (setting_present[MODEL_LAZY_LINKS])
+		fprintf(stdout, msg, ms[MODEL_LAZY_LINKS]);
+	if (setting_present[MODEL_MOBILITY_TRACE])
+		fprintf(stdout, msg, ms[MODEL_MOBILITY_TRACE]);
+	if (setting_present[MODEL_MOBILITY_TRACE_FORMAT])
+		fprintf(stdout, msg, ms[MODEL_MOBILITY_TRACE_FORMAT]);
 	free((void *)msg);
 
 	info->model_index = MN_PROB;
@@ -797,15 +1405,46 @@ static bool configure_model_prob(config_setting_t *model,
 			return false;
 		}
 		prob_default = config_setting_get_float(prob_dflt);
+		if (prob_default < 0.0 || prob_default > 1.0) {
+			fprintf(stderr,
+			    "Invalid probability value (%s:%u). "
+			    "Probability should be >= 0.0 and <= 1.0.\n",
+			    config_setting_source_file(prob_dflt),
+			    config_setting_source_line(prob_dflt));
+			return false;
+		}
 	}
 
+	bool compact;
+	if (!configure_model_bool(model, setting_present, MODEL_COMPACT_MATRIX,
+				  CFG_DEFAULT_COMPACT_MATRIX, &compact))
+		return false;
+
 	// if a failure happens it is freed when delete_medium_info() is called.
-	info->prob_matrix = malloc(sizeof(double) * 
-			   	   info->n_interfaces * info->n_interfaces);
-	for (unsigned int i = 0; i < info->n_interfaces; i++)
-		for (unsigned j = 0; j < info->n_interfaces; j++)
-			info->prob_matrix[i * info->n_interfaces + j] =
-				prob_default;
+	void *matrix;
+	if (compact) {
+		size_t n = (size_t) info->n_interfaces * info->n_interfaces;
+
+		info->compact_matrix = true;
+		info->prob_matrix16 = malloc(sizeof(u16) * n);
+		if (info->prob_matrix16 == NULL) {
+			fprintf(stderr, "Out of memory for the error "
+				"probabilities of medium %d\n", info->id);
+			return false;
+		}
+		for (size_t k = 0; k < n; k++)
+			info->prob_matrix16[k] = prob_to_fixed(prob_default);
+		matrix = info->prob_matrix16;
+	} else {
+		info->prob_matrix = malloc(sizeof(double) * 
+				   	   info->n_interfaces *
+					   info->n_interfaces);
+		for (unsigned int i = 0; i < info->n_interfaces; i++)
+			for (unsigned j = 0; j < info->n_interfaces; j++)
+				info->prob_matrix[i * info->n_interfaces + j] =
+					prob_default;
+		matrix = info->prob_matrix;
+	}
 	
 	if (setting_present[MODEL_LINKS]) {
 		config_setting_t *links = config_setting_lookup(model, "links");
@@ -813,8 +1452,9 @@ static bool configure_model_prob(config_setting_t *model,
 			fprintf(stderr, setting_must_be_list, ms[MODEL_LINKS]);
 			return false;
 		}
-		if (!configure_links(links, (void *) info->prob_matrix,
-				     info->n_interfaces, MODEL_PROB)) {
+		if (!configure_links(links, matrix, info->n_interfaces,
+				     MODEL_PROB, compact ?
+				     LINKS_MATRIX_COMPACT : LINKS_MATRIX)) {
 			return false;
 		}
 	}
@@ -822,7 +1462,8 @@ static bool configure_model_prob(config_setting_t *model,
 		ms[MODEL_DEFAULT_PROBABILITY], prob_default, ms[MODEL_LINKS]);
 	
 	info->get_link_snr = get_link_snr_default;
-	info->get_error_prob = get_error_prob_from_matrix;
+	info->get_error_prob = compact ? get_error_prob_from_matrix16 :
+					 get_error_prob_from_matrix;
 	info->move_interfaces = NULL;
 
 	return true;
@@ -939,6 +1580,28 @@ static bool configure_model_path_loss(config_setting_t *model,
 			ms[MODEL_FADING_COEFFICIENT], info->fading_coefficient);
 	}
 
+	bool grid;
+	if (!configure_model_bool(model, setting_present, MODEL_SPATIAL_GRID,
+				  CFG_DEFAULT_SPATIAL_GRID, &grid))
+		return false;
+	bool compact;
+	if (!configure_model_bool(model, setting_present, MODEL_COMPACT_MATRIX,
+				  CFG_DEFAULT_COMPACT_MATRIX, &compact))
+		return false;
+	if (!configure_model_bool(model, setting_present, MODEL_LAZY_LINKS,
+				  CFG_DEFAULT_LAZY_LINKS, &info->lazy_links))
+		return false;
+
+	// the arrays are allocated with the struct itf_arrays
+	if (grid) {
+		info->grid = calloc(1, sizeof(struct spatial_grid));
+		if (info->grid == NULL) {
+			fprintf(stderr, "Out of memory for the spatial grid "
+				"of medium %d\n", info->id);
+			return false;
+		}
+	}
+
 	if (setting_present[MODEL_MOVE_INTERVAL]) {
 		config_setting_t *s = config_setting_lookup(model,
 				ms[MODEL_MOVE_INTERVAL]);
@@ -998,6 +1661,8 @@ static bool configure_model_path_loss(config_setting_t *model,
 			info->interfaces[i].direction_z = 0;
 		}
 	}
+	if (!configure_mobility_trace(model, info, setting_present))
+		return false;
 
 	config_setting_t *tx_powers =
 		config_setting_lookup(model, ms[MODEL_TX_POWERS]);
@@ -1131,12 +1796,42 @@ static bool configure_model_path_loss(config_setting_t *model,
 
 	info->get_link_snr = get_link_snr_from_snr_matrix;
 	info->get_error_prob = _get_error_prob_from_snr;
-
-	info->snr_matrix =
-		calloc(info->n_interfaces * info->n_interfaces, sizeof(int));
-	recalc_path_loss(info);
+	info->get_error_prob_batch = _get_error_prob_batch_from_snr;
+
+	if (!init_itf_arrays(info))
+		goto out_of_memory;
+	if (info->lazy_links) {
+		if (!init_lazy_links(info))
+			goto out_of_memory;
+		info->get_link_snr = get_link_snr_lazy;
+	} else if (path_loss_uses_snr_lists(info)) {
+		info->snr_lists = snr_lists_new(info->n_interfaces,
+			info->grid->unreachable_snr, true);
+		if (info->snr_lists == NULL)
+			goto out_of_memory;
+		info->get_link_snr = get_link_snr_from_snr_lists;
+	} else if (compact) {
+		info->compact_matrix = true;
+		info->snr_matrix16 = calloc((size_t) info->n_interfaces *
+					    info->n_interfaces, sizeof(s16));
+		if (info->snr_matrix16 == NULL)
+			goto out_of_memory;
+		info->get_link_snr = get_link_snr_from_snr_matrix16;
+	} else {
+		info->snr_matrix = calloc(info->n_interfaces *
+					  info->n_interfaces, sizeof(int));
+		if (info->snr_matrix == NULL)
+			goto out_of_memory;
+	}
+	recalc_path_loss(info, snr_matrix_of(info), info->snr_lists,
+			 &info->snr_gen);
 
 	return true;
+
+out_of_memory:
+	fprintf(stderr, "Out of memory for the %u interfaces of medium %d\n",
+		info->n_interfaces, info->id);
+	return false;
 }
 
 static bool configure_model_type(config_setting_t *name,
@@ -1226,6 +1921,7 @@ static bool configure_model_type(config_setting_t *name,
 		info->system_loss = config_setting_get_int(sys_loss);
 
 		info->path_loss_func = calc_path_loss_free_space;
+		info->path_loss_row = path_loss_row_free_space;
 		
 	} else if (strcmp(model_name_str[MN_ITU], model_name) == 0) {
 		// required settings: n_floors, floor_pen_factor, power_loss_coef
@@ -1290,6 +1986,7 @@ static bool configure_model_type(config_setting_t *name,
 		info->power_loss_coeff = config_setting_get_int(powerlosscoef);
 
 		info->path_loss_func = calc_path_loss_itu;
+		info->path_loss_row = path_loss_row_itu;
 		
 	} else if (strcmp(model_name_str[MN_TWO_RAY_GROUND], model_name) == 0) {
 		// required settings: system_loss
@@ -1327,6 +2024,7 @@ static bool configure_model_type(config_setting_t *name,
 		info->system_loss = config_setting_get_int(sys_loss);
 
 		info->path_loss_func = calc_path_loss_two_ray_ground;
+		info->path_loss_row = path_loss_row_two_ray_ground;
 
 	} else if (strcmp(model_name_str[MN_LOG_DISTANCE], model_name) == 0) {
 		// required settings: path_loss_exponent, xg
@@ -1377,6 +2075,7 @@ static bool configure_model_type(config_setting_t *name,
 		info->xg = config_setting_get_float(xg);
 
 		info->path_loss_func = calc_path_loss_log_distance;
+		info->path_loss_row = path_loss_row_log_distance;
 
 	} else if (strcmp(model_name_str[MN_LOG_NORMAL_SHADOWING],
 		          model_name) == 0) {
@@ -1428,6 +2127,7 @@ static bool configure_model_type(config_setting_t *name,
 		info->system_loss = config_setting_get_int(sys_loss);
 
 		info->path_loss_func = calc_path_loss_log_normal_shadowing;
+		info->path_loss_row = path_loss_row_log_normal_shadowing;
 
 	} else {
 		fprintf(stderr, "Unknown value of %s = %s (%s:%u).\n",
@@ -1499,6 +2199,91 @@ static bool configure_positions_directions(config_setting_t *list,
 	return true;
 }
 
+/**
+ * @brief Check and open the optional model.mobility_trace, which moves the
+ * interfaces instead of model.directions. Trace time 0 is the configured
+ * positions, each movement of the medium plays move_interval more seconds.
+ *
+ * @return true if there is no trace or it could be opened
+ */
+static bool configure_mobility_trace(config_setting_t *model,
+				     struct medium *info,
+				     bool *setting_present)
+{
+	const char * const *ms = model_sett_str;
+	enum mobility_trace_format format = MOBILITY_TRACE_AUTO;
+	config_setting_t *s;
+	const char *file, *val;
+
+	if (!setting_present[MODEL_MOBILITY_TRACE]) {
+		if (setting_present[MODEL_MOBILITY_TRACE_FORMAT])
+			fprintf(stdout, "Setting %s ignored without %s.\n",
+				ms[MODEL_MOBILITY_TRACE_FORMAT],
+				ms[MODEL_MOBILITY_TRACE]);
+		return true;
+	}
+	s = config_setting_lookup(model, ms[MODEL_MOBILITY_TRACE]);
+	file = config_setting_get_string(s);
+	if (file == NULL) {
+		fprintf(stderr, setting_must_be_string,
+			ms[MODEL_MOBILITY_TRACE],
+			config_setting_source_file(s),
+			config_setting_source_line(s));
+		return false;
+	}
+	if (setting_present[MODEL_MOBILITY_TRACE_FORMAT]) {
+		s = config_setting_lookup(model,
+					  ms[MODEL_MOBILITY_TRACE_FORMAT]);
+		val = config_setting_get_string(s);
+		if (val == NULL) {
+			fprintf(stderr, setting_must_be_string,
+				ms[MODEL_MOBILITY_TRACE_FORMAT],
+				config_setting_source_file(s),
+				config_setting_source_line(s));
+			return false;
+		}
+		for (format = MOBILITY_TRACE_NS2;
+		     format <= MOBILITY_TRACE_BINARY; format++)
+			if (strcmp(val, mobility_trace_format_str[format]) == 0)
+				break;
+		if (format > MOBILITY_TRACE_BINARY) {
+			char *p = config_setting_path(s);
+			fprintf(stderr, "Invalid value for setting %s: %s\n",
+				p, val);
+			free(p);
+			return false;
+		}
+	}
+	if (setting_present[MODEL_DIRECTIONS])
+		fprintf(stdout, "Setting %s ignored with %s.\n",
+			ms[MODEL_DIRECTIONS], ms[MODEL_MOBILITY_TRACE]);
+
+	info->trace = mobility_trace_open(file, format, info->n_interfaces);
+	if (info->trace == NULL)
+		return false;
+	for (unsigned int i = 0; i < info->n_interfaces; i++) {
+		struct interface *itf = &info->interfaces[i];
+
+		itf->direction_x = itf->direction_y = itf->direction_z = 0;
+		mobility_trace_place(info->trace, i, itf->position_x,
+				     itf->position_y, itf->position_z);
+	}
+	// the movements at time 0 are part of the configuration
+	mobility_trace_advance(info->trace, 0.0);
+	for (unsigned int i = 0; i < info->n_interfaces; i++) {
+		struct interface *itf = &info->interfaces[i];
+
+		mobility_trace_position(info->trace, i, &itf->position_x,
+					&itf->position_y, &itf->position_z);
+	}
+	info->trace_time = 0.0;
+	info->move_interfaces = move_interfaces_trace;
+	fprintf(stdout, "Medium %d: %s trace %s\n", info->id,
+		mobility_trace_format_str[mobility_trace_format(info->trace)],
+		file);
+	return true;
+}
+
 
 /******************************************************************************/
 /* Helpers */
@@ -1648,15 +2433,60 @@ void dump_medium_info(struct medium* info)
 		print_matrix_int(info->snr_matrix, info->n_interfaces,
 				 info->n_interfaces);
 	}
+	if (info->snr_lists != NULL) {
+		const struct snr_rows *rows = &info->snr_lists->rows;
+
+		printf("snr_lists: %u links, %d for the others\n",
+		       rows->start[info->n_interfaces],
+		       info->snr_lists->absent_snr);
+		for (unsigned int i = 0; i < info->n_interfaces; i++) {
+			printf("%u:", i);
+			for (unsigned int k = rows->start[i];
+			     k < rows->start[i + 1]; k++)
+				printf(" %u/%d", rows->rx[k], rows->snr[k]);
+			printf("\n");
+		}
+	}
+	if (info->snr_matrix16 != NULL) {
+		printf("snr_matrix (compact):\n");
+		for (unsigned int i = 0; i < info->n_interfaces; i++) {
+			for (unsigned int j = 0; j < info->n_interfaces; j++)
+				printf("%d ", info->snr_matrix16[
+					(size_t) i * info->n_interfaces + j]);
+			printf("\n");
+		}
+	}
+	if (info->lazy_links)
+		printf("lazy_links: %u cached links\n", 1U << info->lazy_bits);
 	if (info->prob_matrix != NULL) {
 		printf("prob_matrix:\n");
 		print_matrix_double(info->prob_matrix, info->n_interfaces,
 				    info->n_interfaces);
 	}
+	if (info->prob_matrix16 != NULL) {
+		printf("prob_matrix (compact):\n");
+		for (unsigned int i = 0; i < info->n_interfaces; i++) {
+			for (unsigned int j = 0; j < info->n_interfaces; j++)
+				printf("%f ", prob_from_fixed(
+					info->prob_matrix16[(size_t) i *
+						info->n_interfaces + j]));
+			printf("\n");
+		}
+	}
 	printf("move_interval = %f\n", info->move_interval);
+	if (info->trace != NULL)
+		printf("mobility_trace: %s, at %f s\n",
+		       mobility_trace_format_str[
+				mobility_trace_format(info->trace)],
+		       info->trace_time);
 	printf("fading_coefficient = %d\n", info->fading_coefficient);
 	printf("noise_level = %d\n", info->noise_level);
 	printf("model_name = %s\n", model_name_str[info->model_index]);
+	printf("overload: max_lateness = %ld us, max_queue = %u, policy = %s\n",
+	       info->overload.max_lateness_usec, info->overload.max_queue,
+	       overload_policy_str[info->overload.policy]);
+	printf("phy: slot_time = %d us, sifs = %d us\n", info->phy.slot_time,
+	       info->phy.sifs);
 	// printf("calc_path_loss = %lu\n", info->path_loss_func);
 	// printf("get_prob_func = %lu\n", info->get_error_prob);
 	// printf("get_snr_func = %lu\n", info->get_link_snr);
@@ -1672,7 +2502,17 @@ static struct medium* new_medium_info()
 {
 	struct medium *info = calloc(1, sizeof(struct medium));
 	INIT_LIST_HEAD(&(info->list));
-	medium_init_qos_queues(info);
+	INIT_LIST_HEAD(&(info->channels));
+	info->overload.max_lateness_usec =
+		(long) (CFG_DEFAULT_OVERLOAD_MAX_LATENESS * 1000);
+	info->overload.max_queue = CFG_DEFAULT_OVERLOAD_MAX_QUEUE;
+	info->overload.policy = OVERLOAD_LOG;
+	info->phy.slot_time = CFG_DEFAULT_SLOT_TIME;
+	info->phy.sifs = CFG_DEFAULT_SIFS;
+	// the link cache entries start at epoch 0, i.e. stale
+	info->link_epoch = 1;
+	// an .snr_gen of 0 makes the first recalc_path_loss() compute it all
+	info->itf_gen = 1;
 	return info;
 }
 
@@ -1689,8 +2529,51 @@ static void delete_medium_info(struct medium *mi)
 			free(mi->interfaces);
 		if (mi->snr_matrix != NULL)
 			free(mi->snr_matrix);
+		snr_lists_free(mi->snr_lists);
 		if (mi->prob_matrix != NULL)
 			free(mi->prob_matrix);
+		free(mi->snr_matrix16);
+		free(mi->prob_matrix16);
+		free(mi->lazy_cache);
+		mobility_trace_close(mi->trace);
+		free(mi->per_cache);
+		free(mi->itf_arrays.x);
+		free(mi->itf_arrays.y);
+		free(mi->itf_arrays.z);
+		free(mi->itf_arrays.tx_gain);
+		free(mi->itf_arrays.rx_gain);
+		free(mi->itf_arrays.freq);
+		free(mi->itf_arrays.rows);
+		free(mi->itf_arrays.dist);
+		free(mi->itf_arrays.path_loss);
+		free(mi->itf_arrays.row_start);
+		free(mi->itf_arrays.row_rx);
+		free(mi->itf_arrays.add_start);
+		free(mi->itf_arrays.add_tx);
+		if (mi->grid != NULL) {
+			free(mi->grid->start);
+			free(mi->grid->itf);
+			free(mi->grid->cx);
+			free(mi->grid->cy);
+			free(mi->grid->cols);
+			free(mi->grid);
+		}
+		if (mi->link_cache != NULL) {
+			for (unsigned int i = 0; i < mi->n_interfaces; i++)
+				free(mi->link_cache[i]);
+			free(mi->link_cache);
+		}
+		free(mi->mcast.itf);
+		free(mi->mcast.snr);
+		free(mi->mcast.prob);
+		free(mi->mcast.rand);
+		free(mi->mcast.lost);
+		free(mi->mcast.rx);
+		struct channel *ch, *tmp;
+		list_for_each_entry_safe(ch, tmp, &mi->channels, list) {
+			list_del(&ch->list);
+			free(ch);
+		}
 		free(mi);
 	}
 	return;
@@ -1711,38 +2594,9 @@ void delete_mediums(struct yawmd *mediums)
 	}
 }
 
-static void wqueue_init(struct wqueue *wqueue, int cw_min, int cw_max)
-{
-	INIT_LIST_HEAD(&wqueue->frames);
-	wqueue->cw_min = cw_min;
-	wqueue->cw_max = cw_max;
-}
-
-/**
- * Initializes the 4 QoS queues
- */
-static void medium_init_qos_queues(struct medium *medium)
-{
-	wqueue_init(&medium->qos_queues[IEEE80211_AC_BK], 15, 1023);
-	wqueue_init(&medium->qos_queues[IEEE80211_AC_BE], 15, 1023);
-	wqueue_init(&medium->qos_queues[IEEE80211_AC_VI], 7, 15);
-	wqueue_init(&medium->qos_queues[IEEE80211_AC_VO], 3, 7);
-}
-
 
 /******************************************************************************/
 
-static double pseudo_normal_distribution(void)
-{
-	int i;
-	double normal = -6.0;
-
-	for (i = 0; i < 12; i++)
-		normal += drand48();
-
-	return normal;
-}
-
 /**
  * @brief Calculates random fading component.
  * 
@@ -1754,8 +2608,8 @@ static double pseudo_normal_distribution(void)
 int get_fading_signal(struct medium *medium)
 {
 	if (medium->fading_coefficient != 0)
-		return (int) ((double) medium->fading_coefficient * 
-				       pseudo_normal_distribution());
+		return (int) ((double) medium->fading_coefficient *
+			      rng_normal(&medium->rng));
 	return 0;
 }
 
@@ -1792,26 +2646,102 @@ static int get_link_snr_from_snr_matrix(struct medium *medium,
 }
 
 /**
- * @brief Calculates error probability depending on the SNR value and the
- * signal modulation used for the transmission.
+ * @brief Get the link SNR from medium->snr_matrix16
  * 
  * @param medium 
- * @param snr 
- * @param rate_idx 
- * @param freq 
- * @param frame_len 
- * @param src 
- * @param dst 
- * @return double 
+ * @param sender 
+ * @param receiver 
+ * @return SNR for the pair (sender, receiver)
+ */
+static int get_link_snr_from_snr_matrix16(struct medium *medium,
+					  struct interface *sender,
+					  struct interface *receiver)
+{
+	return medium->snr_matrix16[
+		(size_t) sender->index * medium->n_interfaces +
+		receiver->index];
+}
+
+/* Index of the receiver rx in the list of the transmitter tx, -1 if it is not
+in it. */
+static long snr_rows_find(const struct snr_rows *rows, unsigned int tx,
+			  unsigned int rx)
+{
+	unsigned int lo = rows->start[tx], hi = rows->start[tx + 1];
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (rows->rx[mid] < rx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < rows->start[tx + 1] && rows->rx[lo] == rx ? (long) lo : -1;
+}
+
+/**
+ * @brief Get the link SNR from medium->snr_lists
+ * 
+ * @param medium 
+ * @param sender 
+ * @param receiver 
+ * @return SNR for the pair (sender, receiver)
+ */
+static int get_link_snr_from_snr_lists(struct medium *medium,
+				       struct interface *sender,
+				       struct interface *receiver)
+{
+	const struct snr_lists *lists = medium->snr_lists;
+	long k = snr_rows_find(&lists->rows, sender->index, receiver->index);
+
+	return k < 0 ? lists->absent_snr : lists->rows.snr[k];
+}
+
+/**
+ * @brief Calculates error probability depending on the SNR value and the
+ * signal modulation used for the transmission.
+ * 
+ * @param medium 
+ * @param snr 
+ * @param rate_idx 
+ * @param freq 
+ * @param frame_len 
+ * @param src 
+ * @param dst 
+ * @return double 
  */
 static double _get_error_prob_from_snr(struct medium *medium, double snr,
 				       unsigned int rate_idx, u32 freq,
 				       int frame_len, struct interface *src,
 				       struct interface *dst)
 {
+	if (medium->per_cache != NULL)
+		return get_error_prob_cached(medium->per_cache, snr, rate_idx,
+					     freq, frame_len);
 	return get_error_prob_from_snr(snr, rate_idx, freq, frame_len);
 }
 
+/**
+ * @brief Batch version of _get_error_prob_from_snr() for the receivers of a
+ * multicast frame. With a per_cache each receiver goes through it, so the
+ * rates and the hit/miss counters are the same as one frame at a time.
+ */
+static void _get_error_prob_batch_from_snr(struct medium *medium,
+					   const int *snr, unsigned int n,
+					   unsigned int rate_idx, u32 freq,
+					   int frame_len, double *prob)
+{
+	if (medium->per_cache != NULL) {
+		for (unsigned int i = 0; i < n; i++)
+			prob[i] = get_error_prob_cached(medium->per_cache,
+							snr[i], rate_idx, freq,
+							frame_len);
+		return;
+	}
+	get_error_prob_batch(snr, n, rate_idx, freq, frame_len, prob);
+}
+
 /**
  * @brief Get the error probability from the medium->prob_matrix.
  * 
@@ -1837,6 +2767,30 @@ static double get_error_prob_from_matrix(struct medium *medium, double snr,
 	return val;
 }
 
+/**
+ * @brief Get the error probability from the medium->prob_matrix16.
+ * 
+ * @param medium 
+ * @param snr 
+ * @param rate_idx 
+ * @param freq 
+ * @param frame_len 
+ * @param src 
+ * @param dst 
+ * @return double
+ */
+static double get_error_prob_from_matrix16(struct medium *medium, double snr,
+					   unsigned int rate_idx, u32 freq,
+					   int frame_len, struct interface *src,
+					   struct interface *dst)
+{
+	if (dst == NULL) // dst is multicast. returned value will not be used.
+		return 0.0;
+
+	return prob_from_fixed(medium->prob_matrix16[
+		(size_t) medium->n_interfaces * src->index + dst->index]);
+}
+
 
 // ----------------------------------------------------------------------------
 
@@ -2038,40 +2992,1114 @@ static int calc_path_loss_two_ray_ground(struct medium *medium,
 	return (int) PL;
 }
 
-static void recalc_path_loss(struct medium *medium)
+// ----------------------------------------------------------------------------
+/*
+ * Path loss of a whole row of the SNR matrix at once, or of the interfaces of
+ * the row within range with the spatial grid. The positions are read
+ * from the arrays of struct itf_arrays, the distances of the row are computed
+ * four at a time with AVX2 when available, and the terms that only depend on
+ * the frequency of the transmitter are computed once per row. The results are
+ * the same as those of the calc_path_loss_*() of each pair.
+ */
+
+static void distance_row_scalar(const struct itf_arrays *a, unsigned int src,
+				unsigned int n, bool planar, double *dist)
+{
+	double x = a->x[src], y = a->y[src], z = a->z[src];
+
+	for (unsigned int j = 0; j < n; j++) {
+		double dx = x - a->x[j], dy = y - a->y[j];
+		double dz = planar ? 0.0 : z - a->z[j];
+		dist[j] = sqrt(dx * dx + dy * dy + dz * dz);
+	}
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void distance_row_avx2(const struct itf_arrays *a, unsigned int src,
+			      unsigned int n, bool planar, double *dist)
+{
+	const __m256d x = _mm256_set1_pd(a->x[src]);
+	const __m256d y = _mm256_set1_pd(a->y[src]);
+	const __m256d z = _mm256_set1_pd(a->z[src]);
+	const __m256d zmask = planar ? _mm256_setzero_pd() :
+				       _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+	unsigned int j = 0;
+
+	for (; j + 4 <= n; j += 4) {
+		__m256d dx = _mm256_sub_pd(x, _mm256_loadu_pd(a->x + j));
+		__m256d dy = _mm256_sub_pd(y, _mm256_loadu_pd(a->y + j));
+		__m256d dz = _mm256_and_pd(zmask, _mm256_sub_pd(z,
+					   _mm256_loadu_pd(a->z + j)));
+		__m256d d2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx),
+							 _mm256_mul_pd(dy, dy)),
+					   _mm256_mul_pd(dz, dz));
+		_mm256_storeu_pd(dist + j, _mm256_sqrt_pd(d2));
+	}
+	for (; j < n; j++) {
+		double dx = a->x[src] - a->x[j], dy = a->y[src] - a->y[j];
+		double dz = planar ? 0.0 : a->z[src] - a->z[j];
+		dist[j] = sqrt(dx * dx + dy * dy + dz * dz);
+	}
+}
+#endif
+
+static void (*distance_row_kernel)(const struct itf_arrays *a,
+				   unsigned int src, unsigned int n,
+				   bool planar, double *dist) =
+	distance_row_scalar;
+
+/* Distances from the interface src to the interfaces cols[], or to every
+interface of the medium if cols is NULL, in the x-y plane if planar. */
+static void distance_row(struct medium *medium, unsigned int src,
+			 const unsigned int *cols, unsigned int n_cols,
+			 bool planar, double *dist)
+{
+	const struct itf_arrays *a = &medium->itf_arrays;
+
+	if (cols == NULL) {
+		distance_row_kernel(a, src, n_cols, planar, dist);
+		return;
+	}
+	for (unsigned int k = 0; k < n_cols; k++) {
+		unsigned int j = cols[k];
+		double dx = a->x[src] - a->x[j], dy = a->y[src] - a->y[j];
+		double dz = planar ? 0.0 : a->z[src] - a->z[j];
+		dist[k] = sqrt(dx * dx + dy * dy + dz * dz);
+	}
+}
+
+/* Frequency of the interface in Hz, as used by calc_path_loss_*(). */
+static double row_frequency(struct medium *medium, unsigned int src)
+{
+	double f = medium->itf_arrays.freq[src] * pow(10, 6);
+
+	return f < 0.1 ? FREQ_CH1 : f;
+}
+
+static void path_loss_row_free_space(struct medium *medium, unsigned int src,
+				     const unsigned int *cols,
+				     unsigned int n_cols, double *dist,
+				     int *path_loss)
+{
+	double lambda = SPEED_LIGHT / row_frequency(medium, src);
+	double denominator = pow(lambda, 2);
+
+	distance_row(medium, src, cols, n_cols, false, dist);
+	for (unsigned int j = 0; j < n_cols; j++) {
+		double numerator = pow((4.0 * M_PI * dist[j]), 2) *
+				   medium->system_loss;
+		path_loss[j] = (int) (10.0 * log10(numerator / denominator));
+	}
+}
+
+static void path_loss_row_log_distance(struct medium *medium, unsigned int src,
+				       const unsigned int *cols,
+				       unsigned int n_cols, double *dist,
+				       int *path_loss)
+{
+	double PL0 = 20.0 * log10(4.0 * M_PI * 1.0 * row_frequency(medium, src) /
+				  SPEED_LIGHT);
+	double k = 10.0 * medium->path_loss_exponent;
+
+	distance_row(medium, src, cols, n_cols, false, dist);
+	for (unsigned int j = 0; j < n_cols; j++)
+		path_loss[j] = (int) (PL0 + k * log10(dist[j]) + medium->xg);
+}
+
+static void path_loss_row_itu(struct medium *medium, unsigned int src,
+			      const unsigned int *cols, unsigned int n_cols,
+			      double *dist, int *path_loss)
+{
+	double f = medium->itf_arrays.freq[src];
+	double PLf;
+	int pL = medium->power_loss_coeff;
+
+	if (f < 0.1)
+		f = FREQ_CH1;
+	PLf = 20.0 * log10(f);
+
+	distance_row(medium, src, cols, n_cols, false, dist);
+	for (unsigned int j = 0; j < n_cols; j++) {
+		int N = pL != 0 ? pL : dist[j] > 16 ? 38 : 28;
+		path_loss[j] = (int) (PLf + N * log10(dist[j]) +
+			medium->floor_pen_factor * medium->n_floors - 28);
+	}
+}
+
+static void path_loss_row_log_normal_shadowing(struct medium *medium,
+					       unsigned int src,
+					       const unsigned int *cols,
+					       unsigned int n_cols,
+					       double *dist, int *path_loss)
+{
+	double PL0 = 20.0 * log10(4.0 * M_PI * 1.0 * row_frequency(medium, src) /
+				  SPEED_LIGHT);
+	double k = 10.0 * medium->path_loss_exponent;
+	double gRandom = 1; // see calc_path_loss_log_normal_shadowing()
+
+	distance_row(medium, src, cols, n_cols, false, dist);
+	for (unsigned int j = 0; j < n_cols; j++)
+		path_loss[j] = (int) (PL0 + k * log10(dist[j]) - gRandom);
+}
+
+static void path_loss_row_two_ray_ground(struct medium *medium,
+					 unsigned int src,
+					 const unsigned int *cols,
+					 unsigned int n_cols, double *dist,
+					 int *path_loss)
+{
+	const struct itf_arrays *a = &medium->itf_arrays;
+	double loss = 10 * log10(medium->system_loss);
+
+	distance_row(medium, src, cols, n_cols, true, dist);
+	for (unsigned int k = 0; k < n_cols; k++) {
+		double z = a->z[cols == NULL ? k : cols[k]];
+
+		path_loss[k] = (int) (10 * log10(pow(a->z[src] * z, 2)) -
+				      10 * log10(pow(dist[k], 4)) - loss);
+	}
+}
+
+// ----------------------------------------------------------------------------
+/*
+ * Spatial grid, see struct spatial_grid. The pairs out of range get the SNR
+ * .unreachable_snr instead of their path loss, and only the interfaces of the
+ * 9 cells around a transmitter are candidates for its row.
+ */
+
+// standard deviations of the fading that still reach the CCA threshold
+#define GRID_FADING_MARGIN	5
+// more frequencies in use than this disable the culling
+#define GRID_MAX_FREQS		16
+// meters; a path loss below the budget this far away disables the culling
+#define GRID_MAX_RANGE		1e7
+
+/*
+ * The distance in the x-y plane beyond which even the strongest transmitter
+ * and receiver of the medium are below DEFAULT_CCA_THRESHOLD, with
+ * GRID_FADING_MARGIN of fading, at any of the frequencies in use. INFINITY if
+ * there is none, e.g. with two_ray_ground, whose path loss decreases with the
+ * distance. The path loss is assumed to grow with the distance; the antennas
+ * are at the greatest height of the medium, so the 3D distance is never
+ * shorter than the one tested.
+ */
+static double grid_range(struct medium *medium)
+{
+	const struct itf_arrays *a = &medium->itf_arrays;
+	u32 freqs[GRID_MAX_FREQS];
+	unsigned int n_freqs = 0;
+	int max_tx = INT_MIN, max_rx = INT_MIN, budget;
+	double max_z = 0.0, range = 1.0;
+
+	for (unsigned int i = 0; i < medium->n_interfaces; i++) {
+		unsigned int k = 0;
+
+		if (a->tx_gain[i] > max_tx)
+			max_tx = a->tx_gain[i];
+		if (a->rx_gain[i] > max_rx)
+			max_rx = a->rx_gain[i];
+		if (fabs(a->z[i]) > max_z)
+			max_z = fabs(a->z[i]);
+		while (k < n_freqs && freqs[k] != a->freq[i])
+			k++;
+		if (k == GRID_MAX_FREQS)
+			return INFINITY;
+		if (k == n_freqs)
+			freqs[n_freqs++] = a->freq[i];
+	}
+	// the largest path loss at which a frame can still be heard
+	budget = max_tx + max_rx - DEFAULT_CCA_THRESHOLD +
+		 GRID_FADING_MARGIN * medium->fading_coefficient;
+
+	for (unsigned int k = 0; k < n_freqs; k++) {
+		struct interface src = { .frequency = freqs[k],
+					 .position_z = max_z };
+		struct interface dst = src;
+		double lo = 0.0, hi = 1.0;
+
+		dst.position_x = GRID_MAX_RANGE;
+		if (medium->path_loss_func(medium, &src, &dst) <= budget)
+			return INFINITY;
+		for (;;) {
+			dst.position_x = hi;
+			if (hi >= GRID_MAX_RANGE ||
+			    medium->path_loss_func(medium, &src, &dst) > budget)
+				break;
+			lo = hi;
+			hi *= 2;
+		}
+		if (hi > GRID_MAX_RANGE)
+			hi = GRID_MAX_RANGE;
+		// hi is always out of range
+		for (int it = 0; it < 48; it++) {
+			dst.position_x = (lo + hi) / 2;
+			if (medium->path_loss_func(medium, &src, &dst) > budget)
+				hi = dst.position_x;
+			else
+				lo = dst.position_x;
+		}
+		if (hi > range)
+			range = hi;
+	}
+	return range;
+}
+
+static unsigned int grid_bucket(const struct spatial_grid *g, long long cx,
+				long long cy)
+{
+	u64 h = (u64) cx * 0x9e3779b97f4a7c15ULL ^
+		(u64) cy * 0xc2b2ae3d27d4eb4fULL;
+
+	return (unsigned int) (h >> (64 - g->bits));
+}
+
+/* Same result for (i, j) and (j, i), so that the rows and the columns of
+recalc_path_loss() agree. */
+static bool grid_in_range(const struct spatial_grid *g,
+			  const struct itf_arrays *a, unsigned int i,
+			  unsigned int j)
 {
-	int path_loss, gains;
-	for (unsigned itf1 = 0; itf1 < medium->n_interfaces; itf1++) {
-		for (unsigned itf2 = 0; itf2 < medium->n_interfaces; itf2++) {
-			if (itf1 == itf2)
+	double dx = a->x[i] - a->x[j], dy = a->y[i] - a->y[j];
+
+	return llabs(g->cx[i] - g->cx[j]) <= 1 &&
+	       llabs(g->cy[i] - g->cy[j]) <= 1 &&
+	       dx * dx + dy * dy <= g->range * g->range;
+}
+
+/* Sort the interfaces by the bucket of their cell. */
+static void grid_build(struct medium *medium)
+{
+	struct spatial_grid *g = medium->grid;
+	const struct itf_arrays *a = &medium->itf_arrays;
+	unsigned int n_buckets = 1U << g->bits;
+
+	memset(g->start, 0, (n_buckets + 1) * sizeof(unsigned int));
+	for (unsigned int i = 0; i < medium->n_interfaces; i++) {
+		g->cx[i] = (long long) floor(a->x[i] / g->range);
+		g->cy[i] = (long long) floor(a->y[i] / g->range);
+		g->start[grid_bucket(g, g->cx[i], g->cy[i]) + 1]++;
+	}
+	for (unsigned int b = 0; b < n_buckets; b++)
+		g->start[b + 1] += g->start[b];
+	// .start[b] moves to the end of bucket b, i.e. the start of b + 1
+	for (unsigned int i = 0; i < medium->n_interfaces; i++)
+		g->itf[g->start[grid_bucket(g, g->cx[i], g->cy[i])]++] = i;
+	for (unsigned int b = n_buckets; b > 0; b--)
+		g->start[b] = g->start[b - 1];
+	g->start[0] = 0;
+}
+
+/* Update the range and the cells to the current struct itf_arrays. */
+static void grid_update(struct medium *medium)
+{
+	struct spatial_grid *g = medium->grid;
+	double range = grid_range(medium);
+
+	if (range != g->range) {
+		// every pair may be culled differently, recalculate them all
+		u32 gen = medium->itf_gen + 1;
+
+		for (unsigned int i = 0; i < medium->n_interfaces; i++)
+			medium->interfaces[i].changed = gen;
+		medium->itf_gen = gen;
+		medium->itf_arrays.gen = gen;
+		g->range = range;
+	}
+	if (isfinite(g->range))
+		grid_build(medium);
+}
+
+/* The interfaces within range of src, in cols. Returns how many. */
+static unsigned int grid_columns(struct medium *medium, unsigned int src,
+				 unsigned int *cols)
+{
+	const struct spatial_grid *g = medium->grid;
+	const struct itf_arrays *a = &medium->itf_arrays;
+	unsigned int seen[9], n_seen = 0, n_cols = 0;
+
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			unsigned int b = grid_bucket(g, g->cx[src] + dx,
+						     g->cy[src] + dy);
+			unsigned int k = 0;
+
+			// two cells may share a bucket
+			while (k < n_seen && seen[k] != b)
+				k++;
+			if (k < n_seen)
 				continue;
-			path_loss = medium->path_loss_func(medium,
-					&(medium->interfaces[itf1]),
-					&(medium->interfaces[itf2]));
-			gains = medium->interfaces[itf1].tx_power +
-				medium->interfaces[itf1].antenna_gain +
-				medium->interfaces[itf2].antenna_gain;
-			medium->snr_matrix[medium->n_interfaces * itf1 + itf2] =
-				gains - path_loss - medium->noise_level;
+			seen[n_seen++] = b;
+			for (k = g->start[b]; k < g->start[b + 1]; k++) {
+				unsigned int j = g->itf[k];
+
+				if (j != src && grid_in_range(g, a, src, j))
+					cols[n_cols++] = j;
+			}
 		}
 	}
+	return n_cols;
+}
+
+/* The spatial grid of the medium if it culls any pair, NULL otherwise. */
+static const struct spatial_grid *culling_grid(struct medium *medium)
+{
+	if (medium->grid == NULL || !isfinite(medium->grid->range))
+		return NULL;
+	return medium->grid;
+}
+
+static bool init_spatial_grid(struct medium *medium, size_t workers)
+{
+	struct spatial_grid *g = medium->grid;
+	unsigned int n = medium->n_interfaces;
+
+	// about one interface per bucket
+	for (g->bits = 1; g->bits < 31 && (1U << g->bits) < n; g->bits++)
+		;
+	g->start = malloc(((1U << g->bits) + 1) * sizeof(unsigned int));
+	g->itf = malloc(n * sizeof(unsigned int));
+	g->cx = malloc(n * sizeof(long long));
+	g->cy = malloc(n * sizeof(long long));
+	g->cols = malloc(workers * n * sizeof(unsigned int));
+	g->range = 0.0;
+	g->unreachable_snr = DEFAULT_CCA_THRESHOLD - medium->noise_level -
+		GRID_FADING_MARGIN * medium->fading_coefficient - 1;
+	return g->start && g->itf && g->cx && g->cy && g->cols;
+}
+
+// ----------------------------------------------------------------------------
+/*
+ * Links calculated on demand, see model.lazy_links.
+ */
+
+// slots of medium.lazy_cache per interface, up to LAZY_MAX_BITS
+#define LAZY_SLOTS_PER_INTERFACE	4
+#define LAZY_MAX_BITS			20
+
+static bool init_lazy_links(struct medium *medium)
+{
+	size_t slots = (size_t) medium->n_interfaces * LAZY_SLOTS_PER_INTERFACE;
+
+	for (medium->lazy_bits = 4; medium->lazy_bits < LAZY_MAX_BITS &&
+	     ((size_t) 1 << medium->lazy_bits) < slots; medium->lazy_bits++)
+		;
+	// .gen 0 is never valid, medium.itf_gen starts at 1
+	medium->lazy_cache = calloc((size_t) 1 << medium->lazy_bits,
+				    sizeof(struct lazy_link));
+	return medium->lazy_cache != NULL;
 }
 
 /**
- * @brief Moves station and recalculates path loss.
+ * @brief Get the link SNR with model.lazy_links: from medium->lazy_cache if
+ * neither interface changed since it was calculated, otherwise calculated from
+ * struct itf_arrays as recalc_path_loss() would. Only called by the event loop
+ * of the medium, which also moves the interfaces and runs recalc_path_loss().
+ * 
+ * @param medium 
+ * @param sender 
+ * @param receiver 
+ * @return SNR for the pair (sender, receiver)
+ */
+static int get_link_snr_lazy(struct medium *medium, struct interface *sender,
+			     struct interface *receiver)
+{
+	const struct spatial_grid *grid = culling_grid(medium);
+	u32 tx = sender->index, rx = receiver->index;
+	u64 key = (u64) tx * medium->n_interfaces + rx;
+	struct lazy_link *l = &medium->lazy_cache[
+		(key * 0x9e3779b97f4a7c15ULL) >> (64 - medium->lazy_bits)];
+
+	if (l->gen != 0 && l->tx == tx && l->rx == rx &&
+	    sender->changed <= l->gen && receiver->changed <= l->gen)
+		return l->snr;
+
+	l->tx = tx;
+	l->rx = rx;
+	l->gen = medium->itf_gen;
+	if (tx == rx)
+		// never set in the matrix
+		l->snr = 0;
+	else if (grid != NULL &&
+		 !grid_in_range(grid, &medium->itf_arrays, tx, rx))
+		l->snr = grid->unreachable_snr;
+	else {
+		const struct itf_arrays *a = &medium->itf_arrays;
+		unsigned int col = rx;
+		int path_loss;
+
+		// a column of the row of recalc_rows(), from the same arrays
+		medium->path_loss_row(medium, tx, &col, 1, a->dist, &path_loss);
+		l->snr = a->tx_gain[tx] + a->rx_gain[rx] - path_loss -
+			 medium->noise_level;
+	}
+	return l->snr;
+}
+
+// ----------------------------------------------------------------------------
+/*
+ * Sparse SNRs, see struct snr_lists.
+ */
+
+// below this number of interfaces the matrix takes at most 4 MB
+#define SPARSE_MIN_INTERFACES	1024
+// at most 1 / SPARSE_MAX_DENSITY of the pairs are links in the lists, which
+// take 16 bytes per link against 4 per pair for the matrix
+#define SPARSE_MAX_DENSITY	8
+
+/* Whether a medium of n interfaces with this number of links keeps its SNRs
+in a struct snr_lists. */
+static bool use_snr_lists(unsigned int n, size_t links)
+{
+	return n >= SPARSE_MIN_INTERFACES &&
+	       links * SPARSE_MAX_DENSITY <= (size_t) n * n;
+}
+
+/* Whether a frame received with this SNR is below the CCA threshold even with
+GRID_FADING_MARGIN of fading. */
+static bool snr_unheard(struct medium *medium, int snr)
+{
+	return snr + medium->noise_level +
+	       GRID_FADING_MARGIN * medium->fading_coefficient <
+	       DEFAULT_CCA_THRESHOLD;
+}
+
+/* Make room for size links. */
+static bool snr_rows_reserve(struct snr_rows *rows, size_t size)
+{
+	unsigned int *rx;
+	int *snr;
+
+	if (size <= rows->capacity)
+		return true;
+	size += size / 4;
+	rx = realloc(rows->rx, size * sizeof(unsigned int));
+	if (rx == NULL)
+		return false;
+	rows->rx = rx;
+	snr = realloc(rows->snr, size * sizeof(int));
+	if (snr == NULL)
+		return false;
+	rows->snr = snr;
+	rows->capacity = size;
+	return true;
+}
+
+static struct snr_lists *snr_lists_new(unsigned int n, int absent_snr,
+				       bool absent_unheard)
+{
+	struct snr_lists *lists = calloc(1, sizeof(struct snr_lists));
+
+	if (lists == NULL)
+		return NULL;
+	lists->rows.start = calloc(n + 1, sizeof(unsigned int));
+	lists->spare.start = calloc(n + 1, sizeof(unsigned int));
+	lists->absent_snr = absent_snr;
+	lists->absent_unheard = absent_unheard;
+	if (lists->rows.start == NULL || lists->spare.start == NULL) {
+		snr_lists_free(lists);
+		return NULL;
+	}
+	return lists;
+}
+
+void snr_lists_free(struct snr_lists *lists)
+{
+	if (lists == NULL)
+		return;
+	free(lists->rows.start);
+	free(lists->rows.rx);
+	free(lists->rows.snr);
+	free(lists->spare.start);
+	free(lists->spare.rx);
+	free(lists->spare.snr);
+	free(lists);
+}
+
+/* A copy of the lists of a medium of n interfaces, NULL if out of memory. */
+struct snr_lists *snr_lists_dup(const struct snr_lists *lists, unsigned int n)
+{
+	struct snr_lists *dup = snr_lists_new(n, lists->absent_snr,
+					      lists->absent_unheard);
+	size_t links = lists->rows.start[n];
+
+	if (dup == NULL)
+		return NULL;
+	if (!snr_rows_reserve(&dup->rows, links)) {
+		snr_lists_free(dup);
+		return NULL;
+	}
+	memcpy(dup->rows.start, lists->rows.start,
+	       (n + 1) * sizeof(unsigned int));
+	memcpy(dup->rows.rx, lists->rows.rx, links * sizeof(unsigned int));
+	memcpy(dup->rows.snr, lists->rows.snr, links * sizeof(int));
+	return dup;
+}
+
+static int compare_snr_link(const void *a, const void *b)
+{
+	const struct snr_link *x = a, *y = b;
+
+	if (x->tx != y->tx)
+		return x->tx < y->tx ? -1 : 1;
+	if (x->rx != y->rx)
+		return x->rx < y->rx ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* Fill the empty lists with the n_links members of model.links. */
+static bool snr_lists_from_links(struct snr_lists *lists, unsigned int n,
+				 struct snr_link *links, unsigned int n_links)
+{
+	struct snr_rows *rows = &lists->rows;
+	unsigned int k = 0;
+
+	if (!snr_rows_reserve(rows, n_links)) {
+		fprintf(stderr, "Out of memory for %u links\n", n_links);
+		return false;
+	}
+	qsort(links, n_links, sizeof(struct snr_link), compare_snr_link);
+	for (unsigned int e = 0; e < n_links; e++) {
+		// the last value of a pair wins, as with the matrix
+		if (e + 1 < n_links && links[e + 1].tx == links[e].tx &&
+		    links[e + 1].rx == links[e].rx)
+			continue;
+		rows->rx[k] = links[e].rx;
+		rows->snr[k] = links[e].snr;
+		rows->start[links[e].tx + 1]++;
+		k++;
+	}
+	for (unsigned int i = 0; i < n; i++)
+		rows->start[i + 1] += rows->start[i];
+	return true;
+}
+
+/* Allocate the struct itf_arrays of the medium, filled by the first
+recalc_path_loss(). */
+static bool init_itf_arrays(struct medium *medium)
+{
+	struct itf_arrays *a = &medium->itf_arrays;
+	unsigned int n = medium->n_interfaces;
+	size_t workers = pool_workers(medium->ctx->path_loss_pool);
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		distance_row_kernel = distance_row_avx2;
+#endif
+	a->x = malloc(n * sizeof(double));
+	a->y = malloc(n * sizeof(double));
+	a->z = malloc(n * sizeof(double));
+	a->tx_gain = malloc(n * sizeof(int));
+	a->rx_gain = malloc(n * sizeof(int));
+	a->freq = malloc(n * sizeof(u32));
+	a->rows = malloc(n * sizeof(unsigned int));
+	a->dist = malloc(workers * n * sizeof(double));
+	a->path_loss = malloc(workers * n * sizeof(int));
+	a->gen = 0;
+	if (medium->grid != NULL && !init_spatial_grid(medium, workers))
+		return false;
+	return a->x && a->y && a->z && a->tx_gain && a->rx_gain && a->freq &&
+	       a->rows && a->dist && a->path_loss;
+}
+
+/*
+ * Copy the interfaces changed since the last call to the arrays. The frequency
+ * of an interface is set by its frames, not by move_interfaces(), so a new
+ * one marks the interface as changed here.
+ */
+static void sync_itf_arrays(struct medium *medium)
+{
+	struct itf_arrays *a = &medium->itf_arrays;
+	u32 gen = medium->itf_gen + 1;
+
+	for (unsigned int i = 0; i < medium->n_interfaces; i++) {
+		struct interface *itf = &medium->interfaces[i];
+
+		if (a->gen != 0 && itf->frequency != a->freq[i]) {
+			itf->changed = gen;
+			medium->itf_gen = gen;
+		} else if (a->gen != 0 && itf->changed <= a->gen) {
+			continue;
+		}
+		a->x[i] = itf->position_x;
+		a->y[i] = itf->position_y;
+		a->z[i] = itf->position_z;
+		a->tx_gain[i] = itf->tx_power + itf->antenna_gain;
+		a->rx_gain[i] = itf->antenna_gain;
+		a->freq[i] = itf->frequency;
+	}
+	a->gen = medium->itf_gen;
+}
+
+struct recalc_job {
+	struct medium		*medium;
+	int			*snr_matrix;
+	s16			*snr_matrix16;	// instead of .snr_matrix
+	struct snr_lists	*snr_lists;	// instead of .snr_matrix
+	u32			snr_gen;	// of snr_matrix before the job
+	unsigned int		n_rows;		// in medium->itf_arrays.rows
+};
+
+static inline void recalc_store(const struct recalc_job *job, size_t k,
+				int snr)
+{
+	if (job->snr_matrix16 != NULL)
+		job->snr_matrix16[k] = snr_to_s16(snr);
+	else
+		job->snr_matrix[k] = snr;
+}
+
+/* The SNR at k of the matrix, and whether it is exact, i.e. not clamped in
+.snr_matrix16. */
+static inline int recalc_load(const struct recalc_job *job, size_t k,
+			      bool *exact)
+{
+	int snr;
+
+	if (job->snr_matrix16 == NULL) {
+		*exact = true;
+		return job->snr_matrix[k];
+	}
+	snr = job->snr_matrix16[k];
+	*exact = snr != INT16_MIN && snr != INT16_MAX;
+	return snr;
+}
+
+/* The rows [begin, end) of the rows to recalculate. */
+static void recalc_rows(void *arg, unsigned int worker, unsigned int begin,
+			unsigned int end)
+{
+	struct recalc_job *job = arg;
+	struct medium *medium = job->medium;
+	const struct itf_arrays *a = &medium->itf_arrays;
+	const struct spatial_grid *grid = culling_grid(medium);
+	unsigned int n = medium->n_interfaces;
+	double *dist = a->dist + (size_t) worker * n;
+	int *path_loss = a->path_loss + (size_t) worker * n;
+	unsigned int *cols = NULL, n_cols = n;
+
+	for (unsigned int r = begin; r < end; r++) {
+		unsigned int i = a->rows[r];
+		size_t row = (size_t) n * i;
+
+		if (grid != NULL) {
+			cols = grid->cols + (size_t) worker * n;
+			n_cols = grid_columns(medium, i, cols);
+			for (unsigned int j = 0; j < n; j++)
+				if (j != i)
+					recalc_store(job, row + j,
+						     grid->unreachable_snr);
+		}
+		medium->path_loss_row(medium, i, cols, n_cols, dist,
+				      path_loss);
+		for (unsigned int k = 0; k < n_cols; k++) {
+			unsigned int j = cols == NULL ? k : cols[k];
+
+			if (j != i)
+				recalc_store(job, row + j,
+					     a->tx_gain[i] + a->rx_gain[j] -
+					     path_loss[k] -
+					     medium->noise_level);
+		}
+	}
+}
+
+/*
+ * The columns of the recalculated rows, in the rows [begin, end) that were not
+ * recalculated. The path loss only depends on the frequency of the transmitter
+ * and on the distance, so it is taken from the recalculated row unless the
+ * frequencies differ.
+ */
+static void recalc_columns(void *arg, unsigned int worker, unsigned int begin,
+			   unsigned int end)
+{
+	struct recalc_job *job = arg;
+	struct medium *medium = job->medium;
+	const struct itf_arrays *a = &medium->itf_arrays;
+	const struct spatial_grid *grid = culling_grid(medium);
+	unsigned int n = medium->n_interfaces;
+
+	for (unsigned int j = begin; j < end; j++) {
+		if (medium->interfaces[j].changed > job->snr_gen)
+			continue;
+		for (unsigned int r = 0; r < job->n_rows; r++) {
+			unsigned int i = a->rows[r];
+			int path_loss, snr;
+			bool exact;
+
+			if (grid != NULL && !grid_in_range(grid, a, j, i)) {
+				recalc_store(job, (size_t) n * j + i,
+					     grid->unreachable_snr);
+				continue;
+			}
+			snr = recalc_load(job, (size_t) n * i + j, &exact);
+			if (a->freq[j] == a->freq[i] && exact)
+				path_loss = a->tx_gain[i] + a->rx_gain[j] -
+					    medium->noise_level - snr;
+			else
+				path_loss = medium->path_loss_func(medium,
+						&medium->interfaces[j],
+						&medium->interfaces[i]);
+			recalc_store(job, (size_t) n * j + i,
+				     a->tx_gain[j] + a->rx_gain[i] -
+				     path_loss - medium->noise_level);
+		}
+	}
+}
+
+/* Below this number of links the helpers cost more than they save. */
+#define RECALC_POOL_MIN_LINKS	4096
+
+static void recalc_run(struct recalc_job *job, unsigned int n, size_t links,
+		       pool_fn fn)
+{
+	struct pool *pool = job->medium->ctx->path_loss_pool;
+
+	pool_run(links < RECALC_POOL_MIN_LINKS ? NULL : pool, n, fn, job);
+}
+
+/* Whether the SNRs of the interface j are recalculated by the job. */
+static bool recalc_changed(const struct recalc_job *job, unsigned int j)
+{
+	return job->snr_gen == 0 ||
+	       job->medium->interfaces[j].changed > job->snr_gen;
+}
+
+/* The receivers of the interface src: those within range of the spatial grid,
+or all the others. Returns how many. */
+unsigned int row_receivers(struct medium *medium, unsigned int src,
+			   unsigned int *rx)
+{
+	unsigned int n_rx = 0;
+
+	if (culling_grid(medium) != NULL)
+		return grid_columns(medium, src, rx);
+	for (unsigned int j = 0; j < medium->n_interfaces; j++)
+		if (j != src)
+			rx[n_rx++] = j;
+	return n_rx;
+}
+
+/* recalc_lists() has no way back. */
+static void recalc_out_of_memory(struct medium *medium)
+{
+	fprintf(stderr, "Out of memory for the SNRs of medium %d\n",
+		medium->id);
+	exit(EXIT_FAILURE);
+}
+
+static void *recalc_realloc(struct medium *medium, void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL)
+		recalc_out_of_memory(medium);
+	return p;
+}
+
+static int compare_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *) a;
+	unsigned int y = *(const unsigned int *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* The lists of the recalculated rows [begin, end), to the receivers found by
+recalc_lists(). */
+static void recalc_list_rows(void *arg, unsigned int worker, unsigned int begin,
+			     unsigned int end)
+{
+	struct recalc_job *job = arg;
+	struct medium *medium = job->medium;
+	const struct itf_arrays *a = &medium->itf_arrays;
+	struct snr_rows *spare = &job->snr_lists->spare;
+	unsigned int n = medium->n_interfaces;
+	double *dist = a->dist + (size_t) worker * n;
+	int *path_loss = a->path_loss + (size_t) worker * n;
+
+	for (unsigned int r = begin; r < end; r++) {
+		unsigned int i = a->rows[r];
+		unsigned int *rx = a->row_rx + a->row_start[r];
+		unsigned int n_rx = a->row_start[r + 1] - a->row_start[r];
+		unsigned int out = spare->start[i];
+
+		qsort(rx, n_rx, sizeof(unsigned int), compare_uint);
+		medium->path_loss_row(medium, i, rx, n_rx, dist, path_loss);
+		for (unsigned int k = 0; k < n_rx; k++) {
+			spare->rx[out + k] = rx[k];
+			spare->snr[out + k] = a->tx_gain[i] + a->rx_gain[rx[k]] -
+					      path_loss[k] - medium->noise_level;
+		}
+	}
+}
+
+/*
+ * The lists [begin, end) that were not recalculated: their old links to the
+ * recalculated rows are dropped, and the recalculated rows that have them in
+ * their list are merged in, with the path loss of recalc_columns().
+ */
+static void recalc_list_columns(void *arg, unsigned int worker,
+				unsigned int begin, unsigned int end)
+{
+	struct recalc_job *job = arg;
+	struct medium *medium = job->medium;
+	const struct itf_arrays *a = &medium->itf_arrays;
+	const struct snr_rows *rows = &job->snr_lists->rows;
+	struct snr_rows *spare = &job->snr_lists->spare;
+
+	for (unsigned int j = begin; j < end; j++) {
+		unsigned int k = rows->start[j], k_end = rows->start[j + 1];
+		unsigned int t = a->add_start[j], t_end = a->add_start[j + 1];
+		unsigned int out = spare->start[j];
+
+		if (recalc_changed(job, j))
+			continue;
+		while (k < k_end || t < t_end) {
+			unsigned int i;
+			int path_loss;
+
+			if (k < k_end && recalc_changed(job, rows->rx[k])) {
+				k++;
+				continue;
+			}
+			if (t == t_end ||
+			    (k < k_end && rows->rx[k] < a->add_tx[t])) {
+				spare->rx[out] = rows->rx[k];
+				spare->snr[out++] = rows->snr[k++];
+				continue;
+			}
+			i = a->add_tx[t++];
+			// j is in the list of i, within range is symmetric
+			if (a->freq[j] == a->freq[i])
+				path_loss = a->tx_gain[i] + a->rx_gain[j] -
+					    medium->noise_level -
+					    spare->snr[snr_rows_find(spare, i, j)];
+			else
+				path_loss = medium->path_loss_func(medium,
+						&medium->interfaces[j],
+						&medium->interfaces[i]);
+			spare->rx[out] = i;
+			spare->snr[out++] = a->tx_gain[j] + a->rx_gain[i] -
+					    path_loss - medium->noise_level;
+		}
+	}
+}
+
+/*
+ * recalc_path_loss() into struct snr_lists, rebuilt into .spare in
+ * O(n + links): the recalculated rows from the receivers within range, the
+ * other lists from their old version. The spatial grid gives the receivers,
+ * and tells the others which recalculated rows now reach them.
+ */
+static void recalc_lists(struct recalc_job *job)
+{
+	struct medium *medium = job->medium;
+	struct itf_arrays *a = &medium->itf_arrays;
+	struct snr_rows *rows = &job->snr_lists->rows;
+	struct snr_rows *spare = &job->snr_lists->spare;
+	struct snr_rows tmp;
+	unsigned int n = medium->n_interfaces;
+	size_t n_rx = 0;
+
+	if (job->n_rows == 0)
+		return;
+	if (a->row_start == NULL) {
+		a->row_start = recalc_realloc(medium, NULL,
+					      (n + 1) * sizeof(unsigned int));
+		a->add_start = recalc_realloc(medium, NULL,
+					      (n + 1) * sizeof(unsigned int));
+	}
+
+	// The receivers of the recalculated rows, and the new length of every
+	// list in spare->start[j + 1]: the same, minus the links to the
+	// recalculated rows, plus the links to those within range.
+	memset(a->add_start, 0, (n + 1) * sizeof(unsigned int));
+	spare->start[0] = 0;
+	for (unsigned int j = 0; j < n; j++)
+		spare->start[j + 1] = rows->start[j + 1] - rows->start[j];
+	for (unsigned int r = 0; r < job->n_rows; r++) {
+		unsigned int i = a->rows[r];
+		unsigned int count, *rx;
+
+		if (n_rx + n > a->row_rx_size) {
+			a->row_rx_size = 2 * a->row_rx_size + n;
+			a->row_rx = recalc_realloc(medium, a->row_rx,
+				a->row_rx_size * sizeof(unsigned int));
+		}
+		a->row_start[r] = n_rx;
+		rx = a->row_rx + n_rx;
+		count = row_receivers(medium, i, rx);
+		n_rx += count;
+		spare->start[i + 1] = count;
+		for (unsigned int k = rows->start[i]; k < rows->start[i + 1];
+		     k++)
+			if (!recalc_changed(job, rows->rx[k]))
+				spare->start[rows->rx[k] + 1]--;
+		for (unsigned int k = 0; k < count; k++) {
+			if (!recalc_changed(job, rx[k])) {
+				spare->start[rx[k] + 1]++;
+				a->add_start[rx[k] + 1]++;
+			}
+		}
+	}
+	a->row_start[job->n_rows] = n_rx;
+	for (unsigned int j = 0; j < n; j++) {
+		spare->start[j + 1] += spare->start[j];
+		a->add_start[j + 1] += a->add_start[j];
+	}
+	if (!snr_rows_reserve(spare, spare->start[n]))
+		recalc_out_of_memory(medium);
+	if (a->add_start[n] > a->add_tx_size) {
+		a->add_tx_size = a->add_start[n];
+		a->add_tx = recalc_realloc(medium, a->add_tx,
+					   a->add_tx_size * sizeof(unsigned int));
+	}
+
+	// The recalculated rows to add to each list, ascending as a->rows.
+	// .add_start[j] moves to the end of the list j, as in grid_build().
+	for (unsigned int r = 0; r < job->n_rows; r++)
+		for (unsigned int k = a->row_start[r]; k < a->row_start[r + 1];
+		     k++)
+			if (!recalc_changed(job, a->row_rx[k]))
+				a->add_tx[a->add_start[a->row_rx[k]]++] =
+					a->rows[r];
+	for (unsigned int j = n; j > 0; j--)
+		a->add_start[j] = a->add_start[j - 1];
+	a->add_start[0] = 0;
+
+	recalc_run(job, job->n_rows, n_rx, recalc_list_rows);
+	if (job->n_rows < n)
+		recalc_run(job, n, spare->start[n], recalc_list_columns);
+	tmp = *rows;
+	*rows = *spare;
+	*spare = tmp;
+}
+
+/* Whether a path_loss medium keeps its SNRs in struct snr_lists: only when
+its spatial grid culls most of the pairs at the initial positions. */
+static bool path_loss_uses_snr_lists(struct medium *medium)
+{
+	struct spatial_grid *g = medium->grid;
+	size_t links = 0;
+
+	if (g == NULL || medium->n_interfaces < SPARSE_MIN_INTERFACES)
+		return false;
+	sync_itf_arrays(medium);
+	grid_update(medium);
+	if (culling_grid(medium) == NULL)
+		return false;
+	for (unsigned int i = 0; i < medium->n_interfaces; i++)
+		links += grid_columns(medium, i, g->cols);
+	return use_snr_lists(medium->n_interfaces, links);
+}
+
+/**
+ * @brief Calculates the SNR of every pair of interfaces of the medium from
+ * their current positions. Only the rows and columns of the interfaces changed
+ * since generation *snr_gen are recalculated, O(k * n) for k moving
+ * interfaces; all of them if *snr_gen is 0. The rows are split between the
+ * threads of simulation.path_loss_threads, if any. With model.spatial_grid the
+ * path loss is only calculated for the pairs within range.
+ * 
+ * @param medium 
+ * @param snr_matrix - destination, n_interfaces x n_interfaces of s16 with
+ * model.compact_matrix, of int otherwise. It does not need to be
+ * medium->snr_matrix, see struct mobility.
+ * @param snr_lists - destination instead of snr_matrix if this is NULL.
+ * @param snr_gen - medium->itf_gen when snr_matrix was last updated, set to
+ * the current one.
+ */
+void recalc_path_loss(struct medium *medium, void *snr_matrix,
+		      struct snr_lists *snr_lists, u32 *snr_gen)
+{
+	struct itf_arrays *a = &medium->itf_arrays;
+	unsigned int n = medium->n_interfaces;
+	struct recalc_job job = {
+		.medium = medium,
+		.snr_matrix = medium->compact_matrix ? NULL : snr_matrix,
+		.snr_matrix16 = medium->compact_matrix ? snr_matrix : NULL,
+		.snr_lists = snr_lists,
+		.snr_gen = *snr_gen,
+		.n_rows = 0,
+	};
+
+	sync_itf_arrays(medium);
+	if (medium->grid != NULL)
+		grid_update(medium);
+	// only the arrays and the grid, get_link_snr_lazy() does the rest
+	if (medium->lazy_links) {
+		*snr_gen = medium->itf_gen;
+		return;
+	}
+	for (unsigned int i = 0; i < n; i++)
+		if (job.snr_gen == 0 ||
+		    medium->interfaces[i].changed > job.snr_gen)
+			a->rows[job.n_rows++] = i;
+
+	// The recalculated rows first, then the columns, which read them.
+	if (snr_lists != NULL) {
+		recalc_lists(&job);
+	} else {
+		recalc_run(&job, job.n_rows, (size_t) job.n_rows * n,
+			   recalc_rows);
+		if (job.snr_gen != 0 && job.n_rows > 0 && job.n_rows < n)
+			recalc_run(&job, n, (size_t) job.n_rows * n,
+				   recalc_columns);
+	}
+	*snr_gen = medium->itf_gen;
+}
+
+/**
+ * @brief Moves the stations one step. The path loss is recalculated
+ * separately, see recalc_path_loss().
  * 
  * @param medium 
  * 
  */
 static void move_interfaces(struct medium *medium)
 {
+	u32 gen = medium->itf_gen + 1;
+
+	for (unsigned int i = 0; i < medium->n_interfaces; i++) {
+		struct interface *itf = &medium->interfaces[i];
+
+		if (itf->direction_x == 0.0 && itf->direction_y == 0.0 &&
+		    itf->direction_z == 0.0)
+			continue;
+		itf->position_x += itf->direction_x;
+		itf->position_y += itf->direction_y;
+		itf->position_z += itf->direction_z;
+		itf->changed = gen;
+		medium->itf_gen = gen;
+	}
+}
+
+/**
+ * @brief Moves the stations by move_interval seconds of model.mobility_trace.
+ * Only the interfaces whose position changed are marked for
+ * recalc_path_loss().
+ *
+ * @param medium
+ */
+static void move_interfaces_trace(struct medium *medium)
+{
+	u32 gen = medium->itf_gen + 1;
+
+	medium->trace_time += medium->move_interval;
+	mobility_trace_advance(medium->trace, medium->trace_time);
 	for (unsigned int i = 0; i < medium->n_interfaces; i++) {
-		medium->interfaces[i].position_x +=
-			medium->interfaces[i].direction_x;
-		medium->interfaces[i].position_y +=
-			medium->interfaces[i].direction_y;
-		medium->interfaces[i].position_z +=
-			medium->interfaces[i].direction_z;
-	}
-	recalc_path_loss(medium);
+		struct interface *itf = &medium->interfaces[i];
+		double x, y, z;
+
+		mobility_trace_position(medium->trace, i, &x, &y, &z);
+		if (x == itf->position_x && y == itf->position_y &&
+		    z == itf->position_z)
+			continue;
+		itf->position_x = x;
+		itf->position_y = y;
+		itf->position_z = z;
+		itf->changed = gen;
+		medium->itf_gen = gen;
+	}
 }
@@ -36,13 +36,42 @@ static const int 	CFG_DEFAULT_FADING_COEFFICIENT = 0;
 static const double 	CFG_DEFAULT_MOVE_INTERVAL = 5.0; // seconds
 static const int 	CFG_DEFAULT_ANTENNA_GAIN = 0; // dBm
 static const bool 	CFG_DEFAULT_SIMULATE_INTERFERENCE = false;
+static const bool 	CFG_DEFAULT_SPATIAL_GRID = false;
+static const bool 	CFG_DEFAULT_COMPACT_MATRIX = false;
+static const bool 	CFG_DEFAULT_LAZY_LINKS = false;
 static const bool 	CFG_DEFAULT_ISNODEAPS = false;
+static const double 	CFG_DEFAULT_TIME_DILATION = 1.0;
+static const double 	CFG_DEFAULT_MOBILITY_TICK = 0.0; // from move_interval
+static const double 	CFG_DEFAULT_MOBILITY_START_DELAY = 20.0;
+static const int 	CFG_DEFAULT_PER_CACHE_BUCKET = 0; // disabled
+static const int 	CFG_DEFAULT_LINK_CACHE = 16; // links per transmitter
+static const bool 	CFG_DEFAULT_GEOMETRIC_RETRIES = false;
+static const int 	CFG_DEFAULT_PATH_LOSS_THREADS = 0; // none
+static const int 	CFG_DEFAULT_SLOT_TIME = 9; // us
+static const int 	CFG_DEFAULT_SIFS = 16; // us
+static const double 	CFG_DEFAULT_OVERLOAD_MAX_LATENESS = 100.0; // ms
+static const int 	CFG_DEFAULT_OVERLOAD_MAX_QUEUE = 0; // no limit
 
 bool configure(char *file_name, struct yawmd *ctx);
 void delete_mediums(struct yawmd *mediums);
 
 int get_fading_signal(struct medium *medium);
 
+/* medium->snr_matrix or .snr_matrix16, whichever is in use. */
+static inline void *snr_matrix_of(struct medium *medium)
+{
+	if (medium->snr_matrix16 != NULL)
+		return medium->snr_matrix16;
+	return medium->snr_matrix;
+}
+
+void recalc_path_loss(struct medium *medium, void *snr_matrix,
+		      struct snr_lists *snr_lists, u32 *snr_gen);
+unsigned int row_receivers(struct medium *medium, unsigned int src,
+			   unsigned int *rx);
+struct snr_lists *snr_lists_dup(const struct snr_lists *lists, unsigned int n);
+void snr_lists_free(struct snr_lists *lists);
+
 void dump_medium_info(struct medium* info);
 
 #endif // YAWMD_CONFIG_H_
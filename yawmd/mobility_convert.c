@@ -0,0 +1,124 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+/*
+ * Convert an ns-2 or BonnMotion mobility trace to the binary format of
+ * model.mobility_trace (see mobility_file.h), sorted by time once and for all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include "mobility_trace.h"
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-f FORMAT] OUTPUT INPUT\n"
+		"  -f FORMAT  ns2 | bonnmotion (default: from the contents "
+		"of INPUT)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct mobility_file_header hdr = {
+		.magic = MOBILITY_FILE_MAGIC,
+		.version = MOBILITY_FILE_VERSION,
+	};
+	enum mobility_trace_format format = MOBILITY_TRACE_AUTO;
+	struct mobility_file_record rec;
+	struct mobility_trace *trace;
+	const char *output;
+	FILE *out;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "hf:")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (strcmp(optarg, "ns2") == 0) {
+				format = MOBILITY_TRACE_NS2;
+			} else if (strcmp(optarg, "bonnmotion") == 0) {
+				format = MOBILITY_TRACE_BONNMOTION;
+			} else {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			print_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 2) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	output = argv[optind];
+
+	// all the nodes of the input are kept
+	trace = mobility_trace_open(argv[optind + 1], format, 0);
+	if (trace == NULL)
+		return EXIT_FAILURE;
+	if (mobility_trace_format(trace) == MOBILITY_TRACE_BINARY) {
+		fprintf(stderr, "%s is already a binary trace\n",
+			argv[optind + 1]);
+		mobility_trace_close(trace);
+		return EXIT_FAILURE;
+	}
+
+	out = fopen(output, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", output,
+			strerror(errno));
+		mobility_trace_close(trace);
+		return EXIT_FAILURE;
+	}
+	// the header is written again once the records are counted
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		goto fail_write;
+	while (mobility_trace_next(trace, &rec)) {
+		if (fwrite(&rec, sizeof(rec), 1, out) != 1)
+			goto fail_write;
+		hdr.n_records++;
+		if (rec.node >= hdr.n_nodes)
+			hdr.n_nodes = rec.node + 1;
+	}
+	mobility_trace_close(trace);
+	trace = NULL;
+	if (fseek(out, 0, SEEK_SET) != 0 ||
+	    fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		goto fail_write;
+	if (fclose(out) != 0) {
+		out = NULL;
+		goto fail_write;
+	}
+
+	printf("%s: %llu movements of %u nodes\n", output,
+	       (unsigned long long) hdr.n_records, hdr.n_nodes);
+	return EXIT_SUCCESS;
+
+fail_write:
+	fprintf(stderr, "Cannot write %s: %s\n", output, strerror(errno));
+	if (out != NULL)
+		fclose(out);
+	mobility_trace_close(trace);
+	return EXIT_FAILURE;
+}
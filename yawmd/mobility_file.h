@@ -0,0 +1,61 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#ifndef YAWMD_MOBILITY_FILE_H_
+#define YAWMD_MOBILITY_FILE_H_
+
+/*
+ * Binary mobility trace (model.mobility_trace), mapped read-only by yawmd.
+ *
+ * A struct mobility_file_header followed by n_records struct
+ * mobility_file_record in host byte order, in ascending order of time. Each
+ * record is a movement of one node, as the setdest command of ns-2: from its
+ * position at .time the node goes in a straight line to the coordinates of
+ * .flags at .speed, or is placed there at once if .speed is 0. A movement
+ * interrupts the one in progress. Written by mobility_convert from the ns-2
+ * and BonnMotion text formats.
+ */
+
+#include <stdint.h>
+
+#define MOBILITY_FILE_MAGIC	0x544d5759	// "YWMT"
+#define MOBILITY_FILE_VERSION	1
+
+// the coordinates set by a record, the others are kept
+#define MOBILITY_X		0x1
+#define MOBILITY_Y		0x2
+#define MOBILITY_Z		0x4
+
+struct mobility_file_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	n_nodes;	// highest node + 1
+	uint32_t	reserved;
+	uint64_t	n_records;
+};
+
+struct mobility_file_record {
+	double		time;		// seconds from the start of the trace
+	double		x, y, z;	// meters
+	double		speed;		// meters per second
+	uint32_t	node;
+	uint32_t	flags;		// MOBILITY_X | MOBILITY_Y | MOBILITY_Z
+};
+
+#endif /* YAWMD_MOBILITY_FILE_H_ */
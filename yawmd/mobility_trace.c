@@ -0,0 +1,659 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mobility_trace.h"
+
+// longest line of an ns-2 file and number of a BonnMotion file that are read,
+// the rest is cut
+#define TRACE_MAX_LINE		256
+#define TRACE_MAX_NUMBER	64
+// the pages of a file read in order are given back every TRACE_RELEASE_BYTES
+#define TRACE_RELEASE_BYTES	(16 << 20)
+
+/* A part of the file whose records are in order of time. */
+struct trace_run {
+	const char			*cur, *end;
+	struct mobility_file_record	next;	// first record not played
+	// BonnMotion: the node of the line and its last waypoint
+	unsigned int			node;
+	bool				started;
+	double				wp_time, wp_x, wp_y;
+};
+
+/* The movement in progress of a node: from p0 at t0 to p1 at t1. */
+struct trace_node {
+	double	t0, t1;
+	double	p0[3], p1[3];
+};
+
+struct mobility_trace {
+	char				*file_name;
+	const char			*map;
+	size_t				size;
+	size_t				released;	// pages given back
+	enum mobility_trace_format	format;
+
+	struct trace_run		*runs;
+	unsigned int			n_runs, runs_size;
+	// runs that have a record, by time of .next
+	unsigned int			*heap;
+	unsigned int			heap_size;
+
+	struct trace_node		*nodes;
+	unsigned int			n_nodes;
+	double				time;
+	bool				warned;	// about a node >= n_nodes
+};
+
+/* Copy of the line at *cur, cut to size - 1 characters. */
+static const char *read_line(const char **cur, const char *end, char *buf,
+			     size_t size)
+{
+	const char *nl = memchr(*cur, '\n', end - *cur);
+	size_t len = (nl != NULL ? nl : end) - *cur;
+
+	if (len >= size)
+		len = size - 1;
+	memcpy(buf, *cur, len);
+	buf[len] = '\0';
+	*cur = nl != NULL ? nl + 1 : end;
+	return buf;
+}
+
+static unsigned int axis_flag(char axis)
+{
+	switch (axis) {
+	case 'X':
+		return MOBILITY_X;
+	case 'Y':
+		return MOBILITY_Y;
+	case 'Z':
+		return MOBILITY_Z;
+	default:
+		return 0;
+	}
+}
+
+/* Movement of an ns-2 line, false for the other lines. */
+static bool parse_ns2_line(const char *line, struct mobility_file_record *rec)
+{
+	unsigned int node;
+	double time, x, y, speed, value;
+	char axis;
+
+	memset(rec, 0, sizeof(*rec));
+	if (sscanf(line, " $ns_ at %lf \"$node_(%u) setdest %lf %lf %lf",
+		   &time, &node, &x, &y, &speed) == 5) {
+		rec->time = time;
+		rec->node = node;
+		if (speed > 0.0) {
+			rec->x = x;
+			rec->y = y;
+			rec->speed = speed;
+			rec->flags = MOBILITY_X | MOBILITY_Y;
+		}
+		// with a speed of 0 the node stops where it is
+		return time >= 0.0;
+	}
+	if (sscanf(line, " $ns_ at %lf \"$node_(%u) set %c_ %lf", &time, &node,
+		   &axis, &value) != 4) {
+		time = 0.0;
+		if (sscanf(line, " $node_(%u) set %c_ %lf", &node, &axis,
+			   &value) != 3)
+			return false;
+	}
+	rec->flags = axis_flag(axis);
+	if (rec->flags == 0 || time < 0.0)
+		return false;
+	rec->time = time;
+	rec->node = node;
+	rec->x = rec->y = rec->z = value;
+	return true;
+}
+
+static bool next_ns2(struct trace_run *run)
+{
+	char line[TRACE_MAX_LINE];
+
+	while (run->cur < run->end)
+		if (parse_ns2_line(read_line(&run->cur, run->end, line,
+					     sizeof(line)), &run->next))
+			return true;
+	return false;
+}
+
+/* Next number of a BonnMotion line, false at its end. */
+static bool next_number(struct trace_run *run, double *value)
+{
+	char buf[TRACE_MAX_NUMBER];
+	const char *p = run->cur;
+	char *end;
+	size_t len;
+
+	while (p < run->end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	for (len = 0; p + len < run->end && p[len] != ' ' &&
+	     p[len] != '\t' && p[len] != '\r'; len++)
+		;
+	run->cur = p + len;
+	if (len == 0 || len >= sizeof(buf))
+		return false;
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	*value = strtod(buf, &end);
+	return *end == '\0';
+}
+
+/*
+ * The waypoints of BonnMotion are the positions of the node at their times:
+ * the node leaves a waypoint at its time, at the speed that brings it to the
+ * next one at the time of the next one.
+ */
+static bool next_bonnmotion(struct mobility_trace *trace,
+			    struct trace_run *run)
+{
+	struct mobility_file_record *rec = &run->next;
+	double t, x, y, dt;
+
+	while (run->cur < run->end &&
+	       (*run->cur == ' ' || *run->cur == '\t' || *run->cur == '\r'))
+		run->cur++;
+	if (run->cur >= run->end)
+		return false;
+	if (!next_number(run, &t) || !next_number(run, &x) ||
+	    !next_number(run, &y) || t < 0.0) {
+		fprintf(stderr, "Invalid waypoint of node %u in %s, the rest "
+			"of its line is ignored\n", run->node,
+			trace->file_name);
+		run->cur = run->end;
+		return false;
+	}
+
+	memset(rec, 0, sizeof(*rec));
+	rec->node = run->node;
+	rec->x = x;
+	rec->y = y;
+	rec->flags = MOBILITY_X | MOBILITY_Y;
+	dt = t - run->wp_time;
+	if (!run->started || dt <= 0.0) {
+		rec->time = t;
+	} else {
+		rec->time = run->wp_time;
+		rec->speed = hypot(x - run->wp_x, y - run->wp_y) / dt;
+	}
+	run->started = true;
+	run->wp_time = t;
+	run->wp_x = x;
+	run->wp_y = y;
+	return true;
+}
+
+static bool next_binary(struct trace_run *run)
+{
+	if ((size_t) (run->end - run->cur) <
+	    sizeof(struct mobility_file_record))
+		return false;
+	memcpy(&run->next, run->cur, sizeof(struct mobility_file_record));
+	run->cur += sizeof(struct mobility_file_record);
+	return true;
+}
+
+static bool run_next(struct mobility_trace *trace, struct trace_run *run)
+{
+	switch (trace->format) {
+	case MOBILITY_TRACE_NS2:
+		return next_ns2(run);
+	case MOBILITY_TRACE_BONNMOTION:
+		return next_bonnmotion(trace, run);
+	default:
+		return next_binary(run);
+	}
+}
+
+static bool heap_less(const struct mobility_trace *trace, unsigned int a,
+		      unsigned int b)
+{
+	double ta = trace->runs[a].next.time, tb = trace->runs[b].next.time;
+
+	return ta < tb || (ta == tb && a < b);
+}
+
+static void heap_down(struct mobility_trace *trace, unsigned int i)
+{
+	unsigned int *heap = trace->heap;
+
+	for (;;) {
+		unsigned int child = 2 * i + 1, tmp;
+
+		if (child >= trace->heap_size)
+			return;
+		if (child + 1 < trace->heap_size &&
+		    heap_less(trace, heap[child + 1], heap[child]))
+			child++;
+		if (!heap_less(trace, heap[child], heap[i]))
+			return;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+static bool add_run(struct mobility_trace *trace, const char *begin,
+		    const char *end, unsigned int node)
+{
+	struct trace_run *run;
+
+	if (trace->n_runs == trace->runs_size) {
+		unsigned int size = trace->runs_size ? 2 * trace->runs_size : 16;
+
+		run = realloc(trace->runs, size * sizeof(struct trace_run));
+		if (run == NULL) {
+			fprintf(stderr, "Out of memory for mobility trace "
+				"%s\n", trace->file_name);
+			return false;
+		}
+		trace->runs = run;
+		trace->runs_size = size;
+	}
+	run = &trace->runs[trace->n_runs++];
+	memset(run, 0, sizeof(*run));
+	run->cur = begin;
+	run->end = end;
+	run->node = node;
+	return true;
+}
+
+/*
+ * Runs of an ns-2 file: a run ends before a movement earlier than the one
+ * before it. The file is read once.
+ */
+static bool split_ns2(struct mobility_trace *trace)
+{
+	const char *cur = trace->map, *end = trace->map + trace->size;
+	const char *begin = cur;
+	struct mobility_file_record rec;
+	char line[TRACE_MAX_LINE];
+	double last = 0.0;
+
+	while (cur < end) {
+		const char *line_start = cur;
+
+		if (!parse_ns2_line(read_line(&cur, end, line, sizeof(line)),
+				    &rec))
+			continue;
+		if (rec.time < last) {
+			if (!add_run(trace, begin, line_start, 0))
+				return false;
+			begin = line_start;
+		}
+		last = rec.time;
+	}
+	return add_run(trace, begin, end, 0);
+}
+
+/* Number of fields of a BonnMotion line. */
+static unsigned int count_fields(const char *p, const char *end)
+{
+	unsigned int n = 0;
+	bool in_field = false;
+
+	for (; p < end; p++) {
+		bool space = *p == ' ' || *p == '\t' || *p == '\r';
+
+		n += !space && !in_field;
+		in_field = !space;
+	}
+	return n;
+}
+
+/*
+ * Clears *inc_2d if the times of the waypoints of a line decrease when it is
+ * read as "t x y", and *inc_3d if they decrease when read as "t x y z".
+ */
+static void waypoint_times(const char *line, const char *end, bool *inc_2d,
+			   bool *inc_3d)
+{
+	struct trace_run run = { .cur = line, .end = end };
+	double value, t2 = 0.0, t3 = 0.0;
+
+	for (unsigned int n = 0; next_number(&run, &value); n++) {
+		if (n % 3 == 0) {
+			*inc_2d &= n == 0 || value >= t2;
+			t2 = value;
+		}
+		if (n % 4 == 0) {
+			*inc_3d &= n == 0 || value >= t3;
+			t3 = value;
+		}
+	}
+}
+
+/*
+ * One run per line of a BonnMotion file, the line of each node. A file of 3D
+ * waypoints is rejected: all its lines have a multiple of 4 fields, and one
+ * has not a multiple of 3 or, when all of them have a multiple of 12, the
+ * times only increase when the lines are read 4 by 4.
+ */
+static bool split_bonnmotion(struct mobility_trace *trace)
+{
+	const char *cur = trace->map, *end = trace->map + trace->size;
+	bool fields_2d = true, fields_3d = true;
+	bool inc_2d = true, inc_3d = true;
+	unsigned int node = 0;
+
+	for (; cur < end; node++) {
+		const char *nl = memchr(cur, '\n', end - cur);
+		const char *line_end = nl != NULL ? nl : end;
+		unsigned int n = count_fields(cur, line_end);
+
+		if (trace->n_nodes > 0 && node >= trace->n_nodes) {
+			fprintf(stderr, "%s moves more nodes than the %u "
+				"interfaces, the others are ignored\n",
+				trace->file_name, trace->n_nodes);
+			trace->warned = true;
+			break;
+		}
+		fields_2d &= n % 3 == 0;
+		fields_3d &= n % 4 == 0;
+		if (!add_run(trace, cur, line_end, node))
+			return false;
+		cur = nl != NULL ? nl + 1 : end;
+	}
+	if (fields_3d && fields_2d)
+		for (unsigned int i = 0; i < trace->n_runs; i++)
+			waypoint_times(trace->runs[i].cur, trace->runs[i].end,
+				       &inc_2d, &inc_3d);
+	if (fields_3d && (!fields_2d || (inc_3d && !inc_2d))) {
+		fprintf(stderr, "%s has 3D waypoints (t x y z), only 2D "
+			"BonnMotion traces are supported\n", trace->file_name);
+		return false;
+	}
+	return true;
+}
+
+static bool split_binary(struct mobility_trace *trace)
+{
+	const struct mobility_file_header *hdr =
+		(const struct mobility_file_header *) trace->map;
+	const char *records = trace->map + sizeof(*hdr);
+
+	if (trace->size < sizeof(*hdr) || hdr->magic != MOBILITY_FILE_MAGIC ||
+	    hdr->version != MOBILITY_FILE_VERSION ||
+	    hdr->n_records != (trace->size - sizeof(*hdr)) /
+			      sizeof(struct mobility_file_record) ||
+	    (trace->size - sizeof(*hdr)) %
+	    sizeof(struct mobility_file_record) != 0) {
+		fprintf(stderr, "%s is not a valid mobility trace (version "
+			"%u), see mobility_convert\n", trace->file_name,
+			MOBILITY_FILE_VERSION);
+		return false;
+	}
+	return add_run(trace, records, trace->map + trace->size, 0);
+}
+
+/* Format of a file: binary from its magic, ns-2 if it starts with a command. */
+static enum mobility_trace_format detect_format(const char *map, size_t size)
+{
+	const char *cur = map, *end = map + size;
+
+	if (size >= sizeof(struct mobility_file_header) &&
+	    ((const struct mobility_file_header *) map)->magic ==
+	    MOBILITY_FILE_MAGIC)
+		return MOBILITY_TRACE_BINARY;
+	while (cur < end) {
+		while (cur < end && (*cur == ' ' || *cur == '\t' ||
+				     *cur == '\r' || *cur == '\n'))
+			cur++;
+		if (cur == end || *cur != '#')
+			break;
+		cur = memchr(cur, '\n', end - cur);
+		if (cur == NULL)
+			break;
+	}
+	return cur != NULL && cur < end && *cur == '$' ? MOBILITY_TRACE_NS2 :
+	       MOBILITY_TRACE_BONNMOTION;
+}
+
+struct mobility_trace *mobility_trace_open(const char *file_name,
+					   enum mobility_trace_format format,
+					   unsigned int n_nodes)
+{
+	struct mobility_trace *trace;
+	struct stat st;
+	void *map;
+	bool ok = true;
+	int fd;
+
+	fd = open(file_name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Cannot open mobility trace %s: %s\n",
+			file_name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	if (st.st_size == 0) {
+		fprintf(stderr, "Mobility trace %s is empty\n", file_name);
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Cannot map mobility trace %s: %s\n",
+			file_name, strerror(errno));
+		return NULL;
+	}
+
+	trace = calloc(1, sizeof(struct mobility_trace));
+	if (trace == NULL)
+		goto fail_map;
+	trace->file_name = strdup(file_name);
+	trace->map = map;
+	trace->size = st.st_size;
+	trace->n_nodes = n_nodes;
+	if (n_nodes > 0) {
+		trace->nodes = calloc(n_nodes, sizeof(struct trace_node));
+		if (trace->nodes == NULL)
+			goto fail_trace;
+	}
+	if (trace->file_name == NULL)
+		goto fail_trace;
+
+	trace->format = format != MOBILITY_TRACE_AUTO ? format :
+			detect_format(trace->map, trace->size);
+	switch (trace->format) {
+	case MOBILITY_TRACE_NS2:
+		ok = split_ns2(trace);
+		break;
+	case MOBILITY_TRACE_BONNMOTION:
+		ok = split_bonnmotion(trace);
+		break;
+	default:
+		ok = split_binary(trace);
+		break;
+	}
+	if (!ok)
+		goto fail_trace;
+	if (trace->n_runs == 1)
+		madvise(map, trace->size, MADV_SEQUENTIAL);
+
+	trace->heap = calloc(trace->n_runs, sizeof(unsigned int));
+	if (trace->heap == NULL)
+		goto fail_trace;
+	for (unsigned int i = 0; i < trace->n_runs; i++)
+		if (run_next(trace, &trace->runs[i]))
+			trace->heap[trace->heap_size++] = i;
+	for (unsigned int i = trace->heap_size / 2; i-- > 0;)
+		heap_down(trace, i);
+	return trace;
+
+fail_trace:
+	if (ok)
+		fprintf(stderr, "Out of memory for mobility trace %s\n",
+			file_name);
+	mobility_trace_close(trace);
+	return NULL;
+fail_map:
+	munmap(map, st.st_size);
+	fprintf(stderr, "Out of memory for mobility trace %s\n", file_name);
+	return NULL;
+}
+
+void mobility_trace_close(struct mobility_trace *trace)
+{
+	if (trace == NULL)
+		return;
+	munmap((void *) trace->map, trace->size);
+	free(trace->heap);
+	free(trace->runs);
+	free(trace->nodes);
+	free(trace->file_name);
+	free(trace);
+}
+
+enum mobility_trace_format mobility_trace_format(
+	const struct mobility_trace *trace)
+{
+	return trace->format;
+}
+
+bool mobility_trace_next(struct mobility_trace *trace,
+			 struct mobility_file_record *record)
+{
+	unsigned int top;
+
+	if (trace->heap_size == 0)
+		return false;
+	top = trace->heap[0];
+	*record = trace->runs[top].next;
+	if (!run_next(trace, &trace->runs[top]))
+		trace->heap[0] = trace->heap[--trace->heap_size];
+	heap_down(trace, 0);
+	return true;
+}
+
+static void node_position(const struct trace_node *n, double time,
+			  double pos[3])
+{
+	double f;
+
+	if (time >= n->t1 || n->t1 <= n->t0) {
+		memcpy(pos, n->p1, sizeof(n->p1));
+		return;
+	}
+	f = time <= n->t0 ? 0.0 : (time - n->t0) / (n->t1 - n->t0);
+	for (int i = 0; i < 3; i++)
+		pos[i] = n->p0[i] + f * (n->p1[i] - n->p0[i]);
+}
+
+/* Start the movement of a record from where the node is at its time. */
+static void node_move(struct trace_node *n,
+		      const struct mobility_file_record *rec)
+{
+	const double target[3] = { rec->x, rec->y, rec->z };
+	double pos[3], dist = 0.0;
+
+	node_position(n, rec->time, pos);
+	memcpy(n->p0, pos, sizeof(pos));
+	memcpy(n->p1, pos, sizeof(pos));
+	for (int i = 0; i < 3; i++)
+		if (rec->flags & (MOBILITY_X << i)) {
+			n->p1[i] = target[i];
+			dist += (n->p1[i] - n->p0[i]) * (n->p1[i] - n->p0[i]);
+		}
+	dist = sqrt(dist);
+	n->t0 = rec->time;
+	if (rec->speed > 0.0 && dist > 0.0) {
+		n->t1 = rec->time + dist / rec->speed;
+	} else {
+		memcpy(n->p0, n->p1, sizeof(n->p0));
+		n->t1 = rec->time;
+	}
+}
+
+void mobility_trace_place(struct mobility_trace *trace, unsigned int node,
+			  double x, double y, double z)
+{
+	struct trace_node *n;
+
+	if (node >= trace->n_nodes)
+		return;
+	n = &trace->nodes[node];
+	n->p0[0] = n->p1[0] = x;
+	n->p0[1] = n->p1[1] = y;
+	n->p0[2] = n->p1[2] = z;
+	n->t0 = n->t1 = 0.0;
+}
+
+/* Give back the pages of a file read in order that were played. */
+static void release_pages(struct mobility_trace *trace)
+{
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t done = (size_t) (trace->runs[0].cur - trace->map) & ~(page - 1);
+
+	if (done - trace->released < TRACE_RELEASE_BYTES)
+		return;
+	madvise((void *) (trace->map + trace->released),
+		done - trace->released, MADV_DONTNEED);
+	trace->released = done;
+}
+
+void mobility_trace_advance(struct mobility_trace *trace, double time)
+{
+	struct mobility_file_record rec;
+
+	while (trace->heap_size > 0 &&
+	       trace->runs[trace->heap[0]].next.time <= time) {
+		mobility_trace_next(trace, &rec);
+		if (rec.node < trace->n_nodes) {
+			node_move(&trace->nodes[rec.node], &rec);
+		} else if (!trace->warned) {
+			fprintf(stderr, "%s moves node %u, beyond the %u "
+				"interfaces; ignored\n", trace->file_name,
+				rec.node, trace->n_nodes);
+			trace->warned = true;
+		}
+	}
+	trace->time = time;
+	if (trace->n_runs == 1)
+		release_pages(trace);
+}
+
+void mobility_trace_position(const struct mobility_trace *trace,
+			     unsigned int node, double *x, double *y,
+			     double *z)
+{
+	double pos[3];
+
+	node_position(&trace->nodes[node], trace->time, pos);
+	*x = pos[0];
+	*y = pos[1];
+	*z = pos[2];
+}
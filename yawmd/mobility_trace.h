@@ -0,0 +1,75 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#ifndef MOBILITY_TRACE_H_
+#define MOBILITY_TRACE_H_
+
+/*
+ * Playback of a mobility trace file (model.mobility_trace).
+ *
+ * The file is mapped and read as the simulated time advances: only the
+ * movement in progress of each node is kept in memory, never the trace. The
+ * formats are:
+ *
+ * - ns-2, as written by setdest or the NSFile export of BonnMotion:
+ *     $node_(0) set X_ 12.5
+ *     $ns_ at 3.0 "$node_(0) setdest 40.0 20.0 1.5"
+ *   The other lines ($god_, comments) are ignored.
+ * - BonnMotion (.movements): one line per node, "time x y" waypoints.
+ * - the binary format of mobility_file.h, written by mobility_convert.
+ *
+ * A text file need not be sorted by time: it is read as the sorted runs of
+ * lines it is made of, merged by time. Each node of an ns-2 file exported by
+ * BonnMotion is one run, a setdest file is one run.
+ */
+
+#include <stdbool.h>
+#include "mobility_file.h"
+
+enum mobility_trace_format {
+	MOBILITY_TRACE_AUTO,	// from the contents of the file
+	MOBILITY_TRACE_NS2,
+	MOBILITY_TRACE_BONNMOTION,
+	MOBILITY_TRACE_BINARY,
+};
+
+struct mobility_trace;
+
+// The positions of the nodes [0, n_nodes) are kept, the movements of the
+// other nodes are ignored. NULL on error, which is printed.
+struct mobility_trace *mobility_trace_open(const char *file_name,
+					   enum mobility_trace_format format,
+					   unsigned int n_nodes);
+void mobility_trace_close(struct mobility_trace *trace);
+enum mobility_trace_format mobility_trace_format(
+	const struct mobility_trace *trace);
+// the movements, in order of time; false at the end of the trace
+bool mobility_trace_next(struct mobility_trace *trace,
+			 struct mobility_file_record *record);
+// position of a node before the trace moves it
+void mobility_trace_place(struct mobility_trace *trace, unsigned int node,
+			  double x, double y, double z);
+// play the movements up to time, which never decreases
+void mobility_trace_advance(struct mobility_trace *trace, double time);
+// position of a node at the time of the last mobility_trace_advance()
+void mobility_trace_position(const struct mobility_trace *trace,
+			     unsigned int node, double *x, double *y,
+			     double *z);
+
+#endif /* MOBILITY_TRACE_H_ */
@@ -29,8 +29,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "yawmd.h"
+#include "per_file.h"
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 
@@ -43,10 +50,52 @@ enum fec_rate {
 	FEC_RATE_5_6,
 };
 
-struct rate {
-	int mbps;
+/* Modulation and code rate. The PER tables have one column per modulation
+and coding class, shared by all the PHYs. */
+enum mcs_class {
+	MCS_BPSK_1_2,
+	MCS_BPSK_3_4,
+	MCS_QPSK_1_2,
+	MCS_QPSK_3_4,
+	MCS_16QAM_1_2,
+	MCS_16QAM_3_4,
+	MCS_64QAM_2_3,
+	MCS_64QAM_3_4,
+	MCS_64QAM_5_6,
+	MCS_256QAM_3_4,
+	MCS_256QAM_5_6,
+	MCS_1024QAM_3_4,
+	MCS_1024QAM_5_6,
+	MCS_CLASSES
+};
+
+static const struct {
 	int mqam;
+	int bits;	// per subcarrier, log2(mqam)
 	enum fec_rate fec;
+} mcs_classes[MCS_CLASSES] = {
+	[MCS_BPSK_1_2] =	{ 2, 1, FEC_RATE_1_2 },
+	[MCS_BPSK_3_4] =	{ 2, 1, FEC_RATE_3_4 },
+	[MCS_QPSK_1_2] =	{ 4, 2, FEC_RATE_1_2 },
+	[MCS_QPSK_3_4] =	{ 4, 2, FEC_RATE_3_4 },
+	[MCS_16QAM_1_2] =	{ 16, 4, FEC_RATE_1_2 },
+	[MCS_16QAM_3_4] =	{ 16, 4, FEC_RATE_3_4 },
+	[MCS_64QAM_2_3] =	{ 64, 6, FEC_RATE_2_3 },
+	[MCS_64QAM_3_4] =	{ 64, 6, FEC_RATE_3_4 },
+	[MCS_64QAM_5_6] =	{ 64, 6, FEC_RATE_5_6 },
+	[MCS_256QAM_3_4] =	{ 256, 8, FEC_RATE_3_4 },
+	[MCS_256QAM_5_6] =	{ 256, 8, FEC_RATE_5_6 },
+	[MCS_1024QAM_3_4] =	{ 1024, 10, FEC_RATE_3_4 },
+	[MCS_1024QAM_5_6] =	{ 1024, 10, FEC_RATE_5_6 },
+};
+
+/* numerator and denominator of each enum fec_rate */
+static const int fec_num[] = { 1, 2, 3, 4, 5 };
+static const int fec_den[] = { 2, 3, 4, 5, 6 };
+
+struct rate {
+	int mbps;
+	enum mcs_class cls;
 };
 
 /*
@@ -58,116 +107,52 @@ static struct rate rateset[] = {
 	 * For rate = 1, 2, 5.5, 11 Mbps, we will use mqam and fec of closest
 	 * rate. Because these rates are not OFDM rate.
 	 */
-	{ .mbps = 10, .mqam = 2, .fec = FEC_RATE_1_2 },
-	{ .mbps = 20, .mqam = 2, .fec = FEC_RATE_1_2 },
-	{ .mbps = 55, .mqam = 2, .fec = FEC_RATE_1_2 },
-	{ .mbps = 110, .mqam = 4, .fec = FEC_RATE_1_2 },
-	{ .mbps = 60, .mqam = 2, .fec = FEC_RATE_1_2 },
-	{ .mbps = 90, .mqam = 2, .fec = FEC_RATE_3_4 },
-	{ .mbps = 120, .mqam = 4, .fec = FEC_RATE_1_2 },
-	{ .mbps = 180, .mqam = 4, .fec = FEC_RATE_3_4 },
-	{ .mbps = 240, .mqam = 16, .fec = FEC_RATE_1_2 },
-	{ .mbps = 360, .mqam = 16, .fec = FEC_RATE_3_4 },
-	{ .mbps = 480, .mqam = 64, .fec = FEC_RATE_2_3 },
-	{ .mbps = 540, .mqam = 64, .fec = FEC_RATE_3_4 },
+	{ .mbps = 10, .cls = MCS_BPSK_1_2 },
+	{ .mbps = 20, .cls = MCS_BPSK_1_2 },
+	{ .mbps = 55, .cls = MCS_BPSK_1_2 },
+	{ .mbps = 110, .cls = MCS_QPSK_1_2 },
+	{ .mbps = 60, .cls = MCS_BPSK_1_2 },
+	{ .mbps = 90, .cls = MCS_BPSK_3_4 },
+	{ .mbps = 120, .cls = MCS_QPSK_1_2 },
+	{ .mbps = 180, .cls = MCS_QPSK_3_4 },
+	{ .mbps = 240, .cls = MCS_16QAM_1_2 },
+	{ .mbps = 360, .cls = MCS_16QAM_3_4 },
+	{ .mbps = 480, .cls = MCS_64QAM_2_3 },
+	{ .mbps = 540, .cls = MCS_64QAM_3_4 },
 };
 static size_t rate_len = ARRAY_SIZE(rateset);
 
-// static struct rate rateset_GI_20[] = {
-// 	/*
-// 	 * For 802.11n: Based on http://mcsindex.com/
-// 	 *
-// 	 */
-// 	{ .mbps = 65, .mqam = 2, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 130, .mqam = 4, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 195, .mqam = 4, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 260, .mqam = 16, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 390, .mqam = 16, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 520, .mqam = 64, .fec = FEC_RATE_2_3 },
-// 	{ .mbps = 585, .mqam = 64, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 650, .mqam = 64, .fec = FEC_RATE_5_6 },
-// 	{ .mbps = 130, .mqam = 2, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 260, .mqam = 4, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 390, .mqam = 4, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 520, .mqam = 16, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 780, .mqam = 16, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 1040, .mqam = 64, .fec = FEC_RATE_2_3 },
-// 	{ .mbps = 1170, .mqam = 64, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 1300, .mqam = 64, .fec = FEC_RATE_4_5 },
-// };
-// static size_t rate_len_GI_20 = ARRAY_SIZE(rateset_GI_20);
-
-// static struct rate rateset_SGI_20[] = {
-// 	/*
-// 	 * For 802.11n: Based on http://mcsindex.com/
-// 	 *
-// 	 */
-// 	{ .mbps = 72, .mqam = 2, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 144, .mqam = 4, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 217, .mqam = 4, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 289, .mqam = 16, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 433, .mqam = 16, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 578, .mqam = 64, .fec = FEC_RATE_2_3 },
-// 	{ .mbps = 650, .mqam = 64, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 722, .mqam = 64, .fec = FEC_RATE_5_6 },
-// 	{ .mbps = 144, .mqam = 2, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 289, .mqam = 4, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 433, .mqam = 4, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 578, .mqam = 16, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 867, .mqam = 16, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 1156, .mqam = 64, .fec = FEC_RATE_2_3 },
-// 	{ .mbps = 1303, .mqam = 64, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 1444, .mqam = 64, .fec = FEC_RATE_5_6 },
-// };
-// static size_t rate_len_SGI_20 = ARRAY_SIZE(rateset_SGI_20);
-
-// static struct rate rateset_GI_40[] = {
-// 	/*
-// 	 * For 802.11n: Based on http://mcsindex.com/
-// 	 *
-// 	 */
-// 	{ .mbps = 135, .mqam = 2, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 270, .mqam = 4, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 405, .mqam = 4, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 540, .mqam = 16, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 810, .mqam = 16, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 1080, .mqam = 64, .fec = FEC_RATE_2_3 },
-// 	{ .mbps = 1215, .mqam = 64, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 1350, .mqam = 64, .fec = FEC_RATE_5_6 },
-// 	{ .mbps = 270, .mqam = 2, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 540, .mqam = 4, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 810, .mqam = 4, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 1080, .mqam = 16, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 1620, .mqam = 16, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 2160, .mqam = 64, .fec = FEC_RATE_2_3 },
-// 	{ .mbps = 2430, .mqam = 64, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 2700, .mqam = 64, .fec = FEC_RATE_5_6 },
-// };
-// static size_t rate_len_GI_40 = ARRAY_SIZE(rateset_GI_40);
-
-// static struct rate rateset_SGI_40[] = {
-// 	/*
-// 	 * For 802.11n: Based on http://mcsindex.com/
-// 	 *
-// 	 */
-// 	{ .mbps = 150, .mqam = 2, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 300, .mqam = 4, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 450, .mqam = 4, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 600, .mqam = 16, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 900, .mqam = 16, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 1200, .mqam = 64, .fec = FEC_RATE_2_3 },
-// 	{ .mbps = 1350, .mqam = 64, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 1500, .mqam = 64, .fec = FEC_RATE_5_6 },
-// 	{ .mbps = 300, .mqam = 2, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 600, .mqam = 4, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 900, .mqam = 4, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 1200, .mqam = 16, .fec = FEC_RATE_1_2 },
-// 	{ .mbps = 1800, .mqam = 16, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 2400, .mqam = 64, .fec = FEC_RATE_2_3 },
-// 	{ .mbps = 2700, .mqam = 64, .fec = FEC_RATE_3_4 },
-// 	{ .mbps = 3000, .mqam = 64, .fec = FEC_RATE_5_6 },
-// };
-// static size_t rate_len_SGI_40 = ARRAY_SIZE(rateset_SGI_40);
+/*
+ * HT (802.11n, MCS 0-7 of each spatial stream), VHT (802.11ac, MCS 0-9) and
+ * HE (802.11ax, MCS 0-11). The MCS common to the three have the same
+ * modulation and code rate.
+ */
+static const enum mcs_class mcs_class_of[] = {
+	MCS_BPSK_1_2, MCS_QPSK_1_2, MCS_QPSK_3_4, MCS_16QAM_1_2,
+	MCS_16QAM_3_4, MCS_64QAM_2_3, MCS_64QAM_3_4, MCS_64QAM_5_6,
+	MCS_256QAM_3_4, MCS_256QAM_5_6, MCS_1024QAM_3_4, MCS_1024QAM_5_6,
+};
+static const unsigned int mcs_count[] = {
+	[RATE_MODE_HT] = 8,
+	[RATE_MODE_VHT] = 10,
+	[RATE_MODE_HE] = 12,
+};
+
+/* Data subcarriers for 20, 40, 80 and 160 MHz. */
+static const int ht_data_subcarriers[] = { 52, 108, 234, 468 };
+static const int he_data_subcarriers[] = { 234, 468, 980, 1960 };
+
+/* Noise of the wider channels, 10 * log10(bandwidth / 20 MHz) [dB]. The SNR of
+the links is for 20 MHz. */
+static const int bw_snr_loss[] = { 0, 3, 6, 9 };
+
+/* OFDM symbol with guard interval in units of 100 ns: HT/VHT long and short
+GI, HE 0.8, 1.6 and 3.2 us GI. */
+static const int ht_symbol_time[] = { 40, 36 };
+static const int he_symbol_time[] = { 136, 144, 160 };
+
+/* Long training fields for 1 to 8 spatial streams. */
+static const int n_ltf[] = { 1, 2, 4, 4, 6, 6, 8, 8 };
 
 static double n_choose_k(double n, double k)
 {
@@ -227,12 +212,12 @@ static double mqam_ber(int m, double snr_db)
 }
 
 /*
- * Compute packet (frame) error rate given a length
+ * Compute the probability that a bit is not corrected by the FEC
  */
-static double per(double ber, enum fec_rate rate, int frame_len)
+static double uncorrected_prob(double ber, enum fec_rate rate)
 {
 	/* free distances for each fec_rate */
-	int d_free[] = { 10, 6, 5 };
+	int d_free[] = { 10, 6, 5, 4, 4 };
 
 	/* initial rate code coefficients */
 	double a_d[5][10] = {
@@ -278,126 +263,512 @@ static double per(double ber, enum fec_rate rate, int frame_len)
 	if (prob_uncorrected > 1)
 		prob_uncorrected = 1;
 
-	return 1.0 - pow(1 - prob_uncorrected, 8 * frame_len);
+	return prob_uncorrected;
+}
+
+/*
+ * Compute packet (frame) error rate given a length, from
+ * log(1 - probability of an uncorrected bit):
+ * 1 - (1 - p)^(8 * len) = 1 - exp(8 * len * log(1 - p))
+ */
+static inline double per(double log_success, int frame_len)
+{
+	if (isinf(log_success))
+		return 1.0;
+	return -expm1(8 * frame_len * log_success);
 }
 
-double get_error_prob_from_snr(double snr, unsigned int rate_idx, u32 freq,
-							   int frame_len)
+static double log_success_prob(double snr, enum mcs_class cls)
 {
-	int m;
-	enum fec_rate fec;
+	int m = mcs_classes[cls].mqam;
 	double ber;
 
-	if (snr <= 0.0)
+	if (m == 2)
+		ber = bpsk_ber(snr);
+	else
+		ber = mqam_ber(m, snr);
+
+	return log1p(-uncorrected_prob(ber, mcs_classes[cls].fec));
+}
+
+/*
+ * Rate code of a rate of HWSIM_ATTR_TX_INFO and its flags. For HT the MCS
+ * index covers all the spatial streams (8 per stream, MCS 0-31), for VHT and
+ * HE the index is (nss - 1) << 4 | mcs.
+ */
+u32 hwsim_rate_code(signed char idx, u16 flags)
+{
+	unsigned int mode, bw, gi = 0;
+	unsigned int mcs, nss;
+
+	if (flags & HWSIM_TX_RC_HE_MCS)
+		mode = RATE_MODE_HE;
+	else if (flags & HWSIM_TX_RC_VHT_MCS)
+		mode = RATE_MODE_VHT;
+	else if (flags & HWSIM_TX_RC_MCS)
+		mode = RATE_MODE_HT;
+	else
+		return (u32) idx;
+
+	if (mode == RATE_MODE_HT && (unsigned char) idx > 31) {
+		// MCS 32 and the unequal modulations of MCS 33-76 are not
+		// modelled: out of range, as VHT and HE MCS above theirs
+		mcs = 0xf;
+		nss = 1;
+	} else if (mode == RATE_MODE_HT) {
+		mcs = (unsigned char) idx % 8;
+		nss = (unsigned char) idx / 8 + 1;
+	} else {
+		mcs = idx & 0xf;
+		nss = ((idx >> 4) & 0x7) + 1;
+	}
+
+	if (flags & HWSIM_TX_RC_160_MHZ_WIDTH)
+		bw = RATE_BW_160;
+	else if (flags & HWSIM_TX_RC_80_MHZ_WIDTH)
+		bw = RATE_BW_80;
+	else if (flags & HWSIM_TX_RC_40_MHZ_WIDTH)
+		bw = RATE_BW_40;
+	else
+		bw = RATE_BW_20;
+
+	if (mode == RATE_MODE_HE)
+		gi = flags & HWSIM_TX_RC_HE_GI_3_2 ? 2 :
+		     (flags & HWSIM_TX_RC_HE_GI_1_6 ? 1 : 0);
+	else if (flags & HWSIM_TX_RC_SHORT_GI)
+		gi = 1;
+
+	return RATE_CODE(mode, mcs, nss, bw, gi);
+}
+
+/* Modulation and coding class of a rate and the SNR lost to the noise of its
+bandwidth. Returns -1 if the rate is not valid. */
+static inline int rate_class(u32 rate, u32 freq, int *snr_loss)
+{
+	unsigned int mode = RATE_MODE(rate);
+
+	*snr_loss = 0;
+	if (mode == RATE_MODE_LEGACY) {
+		if (freq > 5000)
+			    rate += 4;
+		return rate < rate_len ? (int) rateset[rate].cls : -1;
+	}
+	if (RATE_MCS(rate) >= mcs_count[mode])
+		return -1;
+	*snr_loss = bw_snr_loss[RATE_BW(rate)];
+	return mcs_class_of[RATE_MCS(rate)];
+}
+
+/*
+ * Transmission time of the rates, see rate_duration(). Every rate is reduced to
+ * its preamble, its OFDM symbol time and its data bits per symbol (Ndbps).
+ * The number of symbols, ceil(bits / Ndbps), is computed with a multiply-shift
+ * by a reciprocal of Ndbps (Granlund and Montgomery), exact for bits < 2^31.
+ */
+struct rate_timing {
+	u64		magic;	// ceil(2^shift / ndbps)
+	u32		shift;	// 32 + ceil(log2(ndbps))
+	u32		ndbps;
+};
+
+/* [mode][bw][nss - 1][mcs], the legacy rates are [0][0][0][rateset index].
+Invalid MCS get the timing of BPSK 1/2, like their PER. */
+static struct rate_timing rate_timing[4][4][8][16];
+/* [mode][nss - 1] in microseconds: L-STF/LTF/SIG, HT-SIG or VHT-SIG-A (+
+VHT-SIG-B) or RL-SIG + HE-SIG-A, then the STF and LTFs of the PHY. */
+static int rate_preamble[4][8];
+/* [mode][gi] in units of 100 ns. */
+static int rate_symbol[4][4];
+
+static void init_rate_timing(void)
+{
+	for (int mode = 0; mode < 4; mode++) {
+		for (int nss = 1; nss <= 8; nss++) {
+			int ltf = n_ltf[nss - 1];
+			rate_preamble[mode][nss - 1] =
+				mode == RATE_MODE_LEGACY ? 16 + 4 :
+				mode == RATE_MODE_HT ? 20 + 8 + 4 + 4 * ltf :
+				mode == RATE_MODE_VHT ? 20 + 8 + 4 + 4 * ltf + 4 :
+				20 + 4 + 8 + 4 + 8 * ltf;
+		}
+		for (int gi = 0; gi < 4; gi++)
+			rate_symbol[mode][gi] =
+				mode == RATE_MODE_LEGACY ? 40 :
+				mode == RATE_MODE_HE ? he_symbol_time[gi < 3 ? gi : 0] :
+				ht_symbol_time[gi & 1];
+
+		for (int bw = 0; bw < 4; bw++)
+		for (int nss = 1; nss <= 8; nss++)
+		for (unsigned int mcs = 0; mcs < 16; mcs++) {
+			struct rate_timing *t = &rate_timing[mode][bw][nss - 1][mcs];
+			enum mcs_class cls = MCS_BPSK_1_2;
+			int ndbps, l = 0;
+
+			if (mode == RATE_MODE_LEGACY) {
+				/* 4 us symbols, mbps in 100 kbps */
+				size_t idx = mcs < rate_len ? mcs : rate_len - 1;
+				ndbps = 4 * rateset[idx].mbps / 10;
+			} else {
+				if (mcs < mcs_count[mode])
+					cls = mcs_class_of[mcs];
+				ndbps = (mode == RATE_MODE_HE ?
+					 he_data_subcarriers[bw] :
+					 ht_data_subcarriers[bw]) *
+					mcs_classes[cls].bits * nss *
+					fec_num[mcs_classes[cls].fec] /
+					fec_den[mcs_classes[cls].fec];
+			}
+			while ((1 << l) < ndbps)
+				l++;
+			t->ndbps = ndbps;
+			t->shift = 32 + l;
+			t->magic = ((1ULL << t->shift) + ndbps - 1) / ndbps;
+		}
+	}
+}
+
+/*
+ * Transmission time in microseconds of a frame of frame_len bytes: preamble,
+ * signal fields and the OFDM symbols of SERVICE + data + tail bits.
+ */
+int rate_duration(u32 rate, u32 freq, int frame_len)
+{
+	unsigned int mode = RATE_MODE(rate), nss = 1, gi = 0;
+	const struct rate_timing *t;
+	u64 bits = 16 + 8 * (u64) frame_len + 6;
+	u64 n_sym;
+
+	if (mode == RATE_MODE_LEGACY) {
+		// as index_to_rate()
+		size_t idx = freq > 5000 ? rate + 4 : rate;
+		t = &rate_timing[0][0][0][idx < rate_len ? idx : rate_len - 1];
+	} else {
+		nss = RATE_NSS(rate);
+		gi = RATE_GI(rate);
+		t = &rate_timing[mode][RATE_BW(rate)][nss - 1][RATE_MCS(rate)];
+	}
+
+	bits += t->ndbps - 1;
+	if (bits < (1ULL << 31))
+		n_sym = (bits * t->magic) >> t->shift;
+	else
+		n_sym = bits / t->ndbps;
+	return rate_preamble[mode][nss - 1] +
+	       (int) ((n_sym * rate_symbol[mode][gi] + 9) / 10);
+}
+
+/*
+ * The SNR of a link is always an integer (see get_link_snr() and
+ * get_fading_signal()), so log(1 - p) of every rate is precomputed for the
+ * integer SNRs up to PER_TABLE_SNR_MAX, above which p is 0 for every rate.
+ * Other SNRs use the analytical path.
+ */
+#define PER_TABLE_SNR_MAX 64
+
+static double per_table[PER_TABLE_SNR_MAX + 1][MCS_CLASSES];
+static bool per_table_ready = false;
+
+/*
+ * Kernels of the batch evaluation of the receivers of a multicast frame, see
+ * get_error_prob_batch(). by_snr holds the frame error rate for the clamped
+ * SNRs 0..PER_BATCH_SNR_MAX of the transmission. Above PER_BATCH_SNR_MAX the
+ * SNR is above PER_TABLE_SNR_MAX even after the loss of the widest bandwidth.
+ */
+#define PER_BATCH_SNR_MAX (PER_TABLE_SNR_MAX + 10)
+
+static inline int clamp_snr(int snr, int max)
+{
+	return snr < 0 ? 0 : (snr > max ? max : snr);
+}
+
+static void per_batch_gather_scalar(const int *snr, const double *by_snr,
+				    double *prob, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+		prob[i] = by_snr[clamp_snr(snr[i], PER_BATCH_SNR_MAX)];
+}
+
+/* A receiver loses the frame if its uniform draw is <= its error
+probability. */
+static void per_batch_draw_scalar(const double *prob, const double *rand,
+				  bool *lost, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+		lost[i] = rand[i] <= prob[i];
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void per_batch_gather_avx2(const int *snr, const double *by_snr,
+				  double *prob, unsigned int n)
+{
+	const __m128i lo = _mm_setzero_si128();
+	const __m128i hi = _mm_set1_epi32(PER_BATCH_SNR_MAX);
+	unsigned int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *) (snr + i));
+		s = _mm_min_epi32(_mm_max_epi32(s, lo), hi);
+		_mm256_storeu_pd(prob + i, _mm256_i32gather_pd(by_snr, s, 8));
+	}
+	per_batch_gather_scalar(snr + i, by_snr, prob + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void per_batch_draw_avx2(const double *prob, const double *rand,
+				bool *lost, unsigned int n)
+{
+	unsigned int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m256d le = _mm256_cmp_pd(_mm256_loadu_pd(rand + i),
+					   _mm256_loadu_pd(prob + i),
+					   _CMP_LE_OQ);
+		int mask = _mm256_movemask_pd(le);
+		lost[i] = mask & 1;
+		lost[i + 1] = (mask >> 1) & 1;
+		lost[i + 2] = (mask >> 2) & 1;
+		lost[i + 3] = (mask >> 3) & 1;
+	}
+	per_batch_draw_scalar(prob + i, rand + i, lost + i, n - i);
+}
+#endif
+
+static void (*per_batch_gather)(const int *snr, const double *by_snr,
+				double *prob, unsigned int n) =
+	per_batch_gather_scalar;
+static void (*per_batch_draw)(const double *prob, const double *rand,
+			      bool *lost, unsigned int n) =
+	per_batch_draw_scalar;
+
+void init_per_tables(void)
+{
+	init_rate_timing();
+	for (int snr = 1; snr <= PER_TABLE_SNR_MAX; snr++)
+		for (int cls = 0; cls < MCS_CLASSES; cls++)
+			per_table[snr][cls] = log_success_prob(snr, cls);
+	per_table_ready = true;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		per_batch_gather = per_batch_gather_avx2;
+		per_batch_draw = per_batch_draw_avx2;
+	}
+#endif
+}
+
+/*
+ * Measured PER table of simulation.per_file, see per_file.h. The file is
+ * mapped shared and read-only, so the processes of several simulations use
+ * the same pages of the page cache.
+ */
+static const struct per_file_header *per_file = NULL;
+static const float *per_file_data;
+
+bool load_per_file(const char *file_name)
+{
+	const struct per_file_header *hdr;
+	struct stat st;
+	void *map;
+	size_t size;
+	int fd;
+
+	fd = open(file_name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Cannot open PER file %s: %s\n", file_name,
+			strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	if ((size_t) st.st_size < sizeof(struct per_file_header)) {
+		fprintf(stderr, "PER file %s is too short\n", file_name);
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Cannot map PER file %s: %s\n", file_name,
+			strerror(errno));
+		return false;
+	}
+
+	hdr = map;
+	size = sizeof(struct per_file_header) + sizeof(float) *
+	       (size_t) hdr->n_snr * hdr->n_rate * hdr->n_len;
+	if (hdr->magic != PER_FILE_MAGIC ||
+	    hdr->version != PER_FILE_VERSION || hdr->n_snr == 0 ||
+	    hdr->n_rate == 0 || hdr->n_rate > PER_FILE_MAX_COLUMNS ||
+	    hdr->n_len == 0 || (hdr->n_len > 1 && hdr->len_bucket == 0) ||
+	    size != (size_t) st.st_size) {
+		fprintf(stderr, "%s is not a valid PER file (version %u), see "
+			"per_convert\n", file_name, PER_FILE_VERSION);
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	per_file = hdr;
+	per_file_data = (const float *) (hdr + 1);
+	return true;
+}
+
+/* Column of a rate in the PER file, -1 if it has none. */
+static inline int per_file_column(u32 rate, u32 freq)
+{
+	unsigned int column;
+
+	if (RATE_MODE(rate) == RATE_MODE_LEGACY)
+		column = freq > 5000 ? rate + 4 : rate;
+	else
+		column = PER_FILE_MCS_COLUMN + RATE_MCS(rate);
+	return column < per_file->n_rate ? (int) column : -1;
+}
+
+/* Below the first row of the file frames are lost, above the last one the
+PER of the last row is used. */
+static inline double per_file_lookup(double snr, int column, int frame_len)
+{
+	long row = lround(floor(snr)) - per_file->snr_min;
+	unsigned int len_idx = 0;
+
+	if (row < 0)
 		return 1.0;
+	if (row >= (long) per_file->n_snr)
+		row = per_file->n_snr - 1;
+	if (per_file->n_len > 1 && frame_len > 0) {
+		len_idx = (unsigned int) frame_len / per_file->len_bucket;
+		if (len_idx >= per_file->n_len)
+			len_idx = per_file->n_len - 1;
+	}
+	return per_file_data[((size_t) row * per_file->n_rate + column) *
+			     per_file->n_len + len_idx];
+}
 
-	if (freq > 5000)
-		    rate_idx += 4;
+double get_error_prob_from_snr(double snr, u32 rate, u32 freq, int frame_len)
+{
+	int snr_idx, cls, loss, column;
 
-	if (rate_idx >= rate_len)
+	cls = rate_class(rate, freq, &loss);
+	if (cls < 0)
 		return 1.0;
 
-	m = rateset[rate_idx].mqam;
-	fec = rateset[rate_idx].fec;
+	snr -= loss;
+	if (per_file != NULL && (column = per_file_column(rate, freq)) >= 0)
+		return per_file_lookup(snr, column, frame_len);
 
-	if (m == 2)
-		ber = bpsk_ber(snr);
-	else
-		ber = mqam_ber(m, snr);
+	if (snr <= 0.0)
+		return 1.0;
+
+	snr_idx = (int) snr;
+	if (per_table_ready && snr_idx == snr && snr_idx <= PER_TABLE_SNR_MAX)
+		return per(per_table[snr_idx][cls], frame_len);
 
-	return per(ber, fec, frame_len);
+	return per(log_success_prob(snr, cls), frame_len);
 }
 
-// static double get_error_prob_from_per_matrix(struct yawmd *ctx, double snr,
-// 						 unsigned int rate_idx, u32 freq,
-// 					     int frame_len, struct station *src,
-// 					     struct station *dst)
-// {
-// 	int signal_idx;
-
-// 	signal_idx = snr + NOISE_LEVEL - ctx->per_matrix_signal_min;
-
-// 	if (signal_idx < 0)
-// 		return 1.0;
-
-// 	if (signal_idx >= ctx->per_matrix_row_num)
-// 		return 0.0;
-
-// 	if (freq > 5000)
-// 		    rate_idx += 4;
-
-// 	if (rate_idx >= rate_len)
-// 		return 1.0;
-
-// 	return ctx->per_matrix[signal_idx * rate_len + rate_idx];
-// }
-
-// int read_per_file(struct yawmd *ctx, const char *file_name)
-// {
-// 	FILE *fp;
-// 	char line[256];
-// 	int signal;
-// 	size_t i;
-// 	float *temp;
-// 	int size = strlen(file_name) + 2;
-// 	char *filename = malloc(size);
-// 	const char *files[] = {"ax"};
-
-// 	strcpy (filename, file_name);
-//     strcat (filename, files[0]);
-
-// 	fp = fopen(filename, "r");
-// 	if (fp == NULL) {
-// 		w_flogf(ctx, LOG_ERR, stderr,
-// 			"fopen failed %s\n", strerror(errno));
-// 		return EXIT_FAILURE;
-// 	}
-
-// 	ctx->per_matrix_signal_min = 1000;
-// 	while (fscanf(fp, "%s", line) != EOF){
-// 		if (line[0] == '#') {
-// 			if (fgets(line, sizeof(line), fp) == NULL) {
-// 				w_flogf(ctx, LOG_ERR, stderr,
-// 					"Failed to read comment line\n");
-// 				return EXIT_FAILURE;
-// 			}
-// 			continue;
-// 		}
-
-// 		signal = atoi(line);
-// 		if (ctx->per_matrix_signal_min > signal)
-// 			ctx->per_matrix_signal_min = signal;
-
-// 		if (signal - ctx->per_matrix_signal_min < 0) {
-// 			w_flogf(ctx, LOG_ERR, stderr,
-// 				"%s: invalid signal=%d\n", __func__, signal);
-// 			return EXIT_FAILURE;
-// 		}
-
-// 		temp = realloc(ctx->per_matrix, sizeof(float) * rate_len *
-// 				++ctx->per_matrix_row_num);
-// 		if (temp == NULL) {
-// 			w_flogf(ctx, LOG_ERR, stderr,
-// 				"Out of memory(PER file)\n");
-// 			return EXIT_FAILURE;
-// 		}
-// 		ctx->per_matrix = temp;
-
-// 		for (i = 0; i < rate_len; i++) {
-// 			if (fscanf(fp, "%f", &ctx->per_matrix[
-// 				(signal - ctx->per_matrix_signal_min) *
-// 				rate_len + i]) == EOF) {
-// 				w_flogf(ctx, LOG_ERR, stderr,
-// 					"Not enough rate found\n");
-// 				return EXIT_FAILURE;
-// 			}
-// 		}
-// 	}
-
-// 	ctx->get_error_prob = get_error_prob_from_per_matrix;
-
-// 	return EXIT_SUCCESS;
-// }
+/*
+ * Error probabilities prob[i] of one transmission (rate, freq, frame_len) at n
+ * receivers with integer SNRs snr[i]. As only the SNR changes between the
+ * receivers, the rate of each distinct SNR is computed once and the receivers
+ * gather it from that small table.
+ */
+void get_error_prob_batch(const int *snr, unsigned int n, u32 rate, u32 freq,
+			  int frame_len, double *prob)
+{
+	double by_snr[PER_BATCH_SNR_MAX + 1];
+	int lo = PER_BATCH_SNR_MAX, hi = 0;
+	int cls, loss;
+
+	cls = rate_class(rate, freq, &loss);
+	if (!per_table_ready || cls < 0 || per_file != NULL) {
+		for (unsigned int i = 0; i < n; i++)
+			prob[i] = get_error_prob_from_snr(snr[i], rate, freq,
+							  frame_len);
+		return;
+	}
+
+	for (unsigned int i = 0; i < n; i++) {
+		int s = clamp_snr(snr[i], PER_BATCH_SNR_MAX);
+		lo = s < lo ? s : lo;
+		hi = s > hi ? s : hi;
+	}
+	for (int s = lo; s <= hi; s++) {
+		int eff = s - loss;
+		if (s == 0 || eff <= 0)
+			by_snr[s] = 1.0;
+		else if (eff > PER_TABLE_SNR_MAX)
+			by_snr[s] = per(per_table[PER_TABLE_SNR_MAX][cls],
+					frame_len);
+		else
+			by_snr[s] = per(per_table[eff][cls], frame_len);
+	}
+	per_batch_gather(snr, by_snr, prob, n);
+}
+
+void draw_losses_batch(const double *prob, const double *rand, bool *lost,
+		       unsigned int n)
+{
+	per_batch_draw(prob, rand, lost, n);
+}
+
+/*
+ * Cache of frame error rates keyed by (snr, rate, length bucket). Frame lengths
+ * cluster around a few values (ACKs, beacons, TCP MSS), so most frames skip the
+ * expm1() of per(). With a bucket of 1 byte the lengths are exact, otherwise
+ * the rate of a bucket is the one of its middle length.
+ */
+struct per_cache *per_cache_new(unsigned int bucket)
+{
+	struct per_cache *cache = calloc(1, sizeof(struct per_cache));
+
+	if (cache != NULL)
+		cache->bucket = bucket > 0 ? bucket : 1;
+	return cache;
+}
+
+/* Finalizer of MurmurHash3, the fields of the key are in different bytes. */
+static inline u32 per_cache_hash(u32 key)
+{
+	key ^= key >> 16;
+	key *= 0x85ebca6bU;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35U;
+	key ^= key >> 16;
+	return key;
+}
+
+double get_error_prob_cached(struct per_cache *cache, double snr, u32 rate,
+			     u32 freq, int frame_len)
+{
+	struct per_cache_entry *entry;
+	unsigned int bucket = frame_len / cache->bucket;
+	int loss, cls = rate_class(rate, freq, &loss);
+	int snr_idx = (int) snr - loss;
+	u32 key;
+
+	// Only the SNRs of the tables are cached, see init_per_tables().
+	if (!per_table_ready || per_file != NULL ||
+	    (int) snr != snr || snr_idx <= 0 ||
+	    snr_idx > PER_TABLE_SNR_MAX || cls < 0 || frame_len < 0 ||
+	    bucket > 0xffff)
+		return get_error_prob_from_snr(snr, rate, freq, frame_len);
+
+	// bit 31 set so that 0 is never a valid key
+	key = 1U << 31 | (u32) snr_idx << 20 | (u32) cls << 16 | bucket;
+	entry = &cache->entries[per_cache_hash(key) >> (32 - PER_CACHE_BITS)];
+	if (entry->key == key) {
+		cache->hits++;
+		return entry->per;
+	}
+
+	cache->misses++;
+	entry->key = key;
+	if (cache->bucket > 1)
+		frame_len = bucket * cache->bucket + cache->bucket / 2;
+	entry->per = per(per_table[snr_idx][cls], frame_len);
+	return entry->per;
+}
 
 int index_to_rate(size_t index, u32 freq)
 {
@@ -0,0 +1,127 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+/*
+ * Time get_error_prob_from_snr() with the analytical model and with the tables
+ * of init_per_tables(), and print the largest difference between both.
+ *
+ * Until init_per_tables() runs, get_error_prob_from_snr() evaluates the
+ * analytical model, so both are measured through the same function: first
+ * before the tables are built, then after.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include "yawmd.h"
+
+#define BENCH_SNR_MAX	39	// SNRs 0..BENCH_SNR_MAX
+#define BENCH_RATES	8	// legacy rates 0..7
+#define BENCH_FREQ	2412
+
+extern double get_error_prob_from_snr(double snr, u32 rate, u32 freq,
+				      int frame_len);
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Nanoseconds per call over rounds passes of the SNRs and rates. */
+static double time_calls(int rounds, int frame_len, double *sum)
+{
+	double start = now();
+
+	for (int i = 0; i < rounds; i++)
+		for (int snr = 0; snr <= BENCH_SNR_MAX; snr++)
+			for (u32 rate = 0; rate < BENCH_RATES; rate++)
+				*sum += get_error_prob_from_snr(snr, rate,
+						BENCH_FREQ, frame_len);
+	return (now() - start) * 1e9 /
+	       ((double) rounds * (BENCH_SNR_MAX + 1) * BENCH_RATES);
+}
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-l LENGTH] [-n ROUNDS]\n"
+		"  -l LENGTH  frame length in bytes (default 1500)\n"
+		"  -n ROUNDS  passes over SNR 0..%d and rates 0..%d "
+		"(default 200)\n", name, BENCH_SNR_MAX, BENCH_RATES - 1);
+}
+
+int main(int argc, char *argv[])
+{
+	static double analytical[86][BENCH_RATES][3000 / 64 + 1];
+	int frame_len = 1500, rounds = 200, opt;
+	double before, after, sum = 0.0, max_diff = 0.0;
+
+	while ((opt = getopt(argc, argv, "hl:n:")) != -1) {
+		switch (opt) {
+		case 'l':
+			frame_len = atoi(optarg);
+			break;
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (frame_len <= 0 || rounds <= 0) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// SNR -5..80, lengths 14..3000 by steps of 64
+	for (int snr = -5; snr <= 80; snr++)
+		for (u32 rate = 0; rate < BENCH_RATES; rate++)
+			for (int len = 14, k = 0; len <= 3000; len += 64, k++)
+				analytical[snr + 5][rate][k] =
+					get_error_prob_from_snr(snr, rate,
+						BENCH_FREQ, len);
+	before = time_calls(rounds, frame_len, &sum);
+
+	init_per_tables();
+
+	after = time_calls(rounds, frame_len, &sum);
+	for (int snr = -5; snr <= 80; snr++)
+		for (u32 rate = 0; rate < BENCH_RATES; rate++)
+			for (int len = 14, k = 0; len <= 3000; len += 64, k++) {
+				double d = fabs(analytical[snr + 5][rate][k] -
+					get_error_prob_from_snr(snr, rate,
+						BENCH_FREQ, len));
+				if (d > max_diff)
+					max_diff = d;
+			}
+
+	printf("SNR 0..%d, rates 0..%d, %d bytes: %.1f ns/call analytical, "
+	       "%.1f ns/call tables (%.0fx)\n", BENCH_SNR_MAX,
+	       BENCH_RATES - 1, frame_len, before, after, before / after);
+	printf("largest difference over SNR -5..80, lengths 14..3000: %g\n",
+	       max_diff);
+	// keeps the calls from being optimized out
+	return sum < 0.0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
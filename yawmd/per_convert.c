@@ -0,0 +1,254 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+/*
+ * Convert the text PER tables of wmediumd to the binary format of
+ * simulation.per_file (see per_file.h).
+ *
+ * Each line of a text table is a signal level in dBm followed by the frame
+ * error rate of each rate; lines starting with '#' are comments. Each input
+ * file is one length bucket, in increasing order of length.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include "per_file.h"
+
+#define DEFAULT_NOISE_LEVEL -91
+
+struct text_table {
+	int	snr_min, snr_max;
+	int	n_rate;
+	float	*per;		// [snr - snr_min][rate]
+	bool	*present;	// [snr - snr_min]
+};
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-n NOISE] [-b BUCKET] OUTPUT INPUT [INPUT ...]\n"
+		"  -n NOISE   noise level of the tables in dBm (default %d)\n"
+		"  -b BUCKET  bytes of each length bucket, one INPUT per "
+		"bucket\n", name, DEFAULT_NOISE_LEVEL);
+}
+
+/* Number of fields of a line of a table. */
+static int count_fields(char *line)
+{
+	int n = 0;
+
+	for (char *tok = strtok(line, " \t\n"); tok != NULL;
+	     tok = strtok(NULL, " \t\n"))
+		n++;
+	return n;
+}
+
+static bool read_table(const char *file_name, int noise,
+		       struct text_table *table)
+{
+	char line[1024];
+	unsigned int line_nr = 0;
+	FILE *file;
+	int pass;
+
+	file = fopen(file_name, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", file_name,
+			strerror(errno));
+		return false;
+	}
+
+	// first pass: SNR range and number of rates, second pass: values
+	table->snr_min = 1000;
+	table->snr_max = -1000;
+	table->n_rate = 0;
+	for (pass = 0; pass < 2; pass++) {
+		rewind(file);
+		line_nr = 0;
+		while (fgets(line, sizeof(line), file) != NULL) {
+			char *p = line + strspn(line, " \t");
+			char copy[sizeof(line)];
+			int signal, n, offset;
+
+			line_nr++;
+			if (*p == '#' || *p == '\n' || *p == '\0')
+				continue;
+			if (sscanf(p, "%d%n", &signal, &offset) != 1)
+				goto invalid;
+
+			if (pass == 0) {
+				strcpy(copy, p);
+				n = count_fields(copy) - 1;
+				if (table->n_rate == 0)
+					table->n_rate = n;
+				if (n != table->n_rate || n <= 0 ||
+				    n > PER_FILE_MAX_COLUMNS)
+					goto invalid;
+				if (signal - noise < table->snr_min)
+					table->snr_min = signal - noise;
+				if (signal - noise > table->snr_max)
+					table->snr_max = signal - noise;
+				continue;
+			}
+
+			int row = signal - noise - table->snr_min;
+			p += offset;
+			for (int i = 0; i < table->n_rate; i++) {
+				float per;
+				if (sscanf(p, "%f%n", &per, &offset) != 1 ||
+				    per < 0.0 || per > 1.0)
+					goto invalid;
+				table->per[row * table->n_rate + i] = per;
+				p += offset;
+			}
+			table->present[row] = true;
+		}
+		if (table->n_rate == 0) {
+			fprintf(stderr, "%s has no PER values\n", file_name);
+			fclose(file);
+			return false;
+		}
+		if (pass == 0) {
+			int rows = table->snr_max - table->snr_min + 1;
+			table->per = calloc((size_t) rows * table->n_rate,
+					    sizeof(float));
+			table->present = calloc(rows, sizeof(bool));
+			if (table->per == NULL || table->present == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				fclose(file);
+				return false;
+			}
+		}
+	}
+	fclose(file);
+
+	// SNRs missing in the text table take the row below them
+	for (int row = 1; row <= table->snr_max - table->snr_min; row++) {
+		if (table->present[row])
+			continue;
+		memcpy(&table->per[row * table->n_rate],
+		       &table->per[(row - 1) * table->n_rate],
+		       table->n_rate * sizeof(float));
+	}
+	return true;
+
+invalid:
+	fprintf(stderr, "Invalid PER line (%s:%u)\n", file_name, line_nr);
+	fclose(file);
+	return false;
+}
+
+/* PER of a table at an SNR of the output, which can be outside of the range of
+the table. */
+static float table_per(const struct text_table *table, int snr, int rate)
+{
+	if (snr < table->snr_min)
+		return 1.0f;
+	if (snr > table->snr_max)
+		snr = table->snr_max;
+	return table->per[(snr - table->snr_min) * table->n_rate + rate];
+}
+
+int main(int argc, char *argv[])
+{
+	struct per_file_header hdr = {
+		.magic = PER_FILE_MAGIC,
+		.version = PER_FILE_VERSION,
+	};
+	struct text_table *tables;
+	int noise = DEFAULT_NOISE_LEVEL;
+	unsigned int bucket = 0;
+	int n_tables, snr_min = 1000, snr_max = -1000;
+	const char *output;
+	FILE *out;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "hn:b:")) != -1) {
+		switch (opt) {
+		case 'n':
+			noise = atoi(optarg);
+			break;
+		case 'b':
+			bucket = (unsigned int) atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (argc - optind < 2) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	output = argv[optind++];
+	n_tables = argc - optind;
+	if (n_tables > 1 && bucket == 0) {
+		fprintf(stderr, "-b is required with more than one INPUT\n");
+		return EXIT_FAILURE;
+	}
+
+	tables = calloc(n_tables, sizeof(struct text_table));
+	for (int i = 0; i < n_tables; i++) {
+		if (!read_table(argv[optind + i], noise, &tables[i]))
+			return EXIT_FAILURE;
+		if (tables[i].n_rate != tables[0].n_rate) {
+			fprintf(stderr, "%s has %d rates instead of %d\n",
+				argv[optind + i], tables[i].n_rate,
+				tables[0].n_rate);
+			return EXIT_FAILURE;
+		}
+		if (tables[i].snr_min < snr_min)
+			snr_min = tables[i].snr_min;
+		if (tables[i].snr_max > snr_max)
+			snr_max = tables[i].snr_max;
+	}
+
+	hdr.snr_min = snr_min;
+	hdr.n_snr = (uint32_t) (snr_max - snr_min + 1);
+	hdr.n_rate = (uint32_t) tables[0].n_rate;
+	hdr.n_len = (uint32_t) n_tables;
+	hdr.len_bucket = n_tables > 1 ? bucket : 0;
+
+	out = fopen(output, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", output,
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	for (int snr = snr_min; snr <= snr_max; snr++)
+		for (int rate = 0; rate < tables[0].n_rate; rate++)
+			for (int len = 0; len < n_tables; len++) {
+				float per = table_per(&tables[len], snr, rate);
+				fwrite(&per, sizeof(per), 1, out);
+			}
+	if (fclose(out) != 0) {
+		fprintf(stderr, "Cannot write %s: %s\n", output,
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	printf("%s: SNR %d to %d dB, %u rates, %u length buckets\n", output,
+	       snr_min, snr_max, hdr.n_rate, hdr.n_len);
+	return EXIT_SUCCESS;
+}
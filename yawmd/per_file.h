@@ -0,0 +1,56 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#ifndef YAWMD_PER_FILE_H_
+#define YAWMD_PER_FILE_H_
+
+/*
+ * Binary PER table (simulation.per_file), mapped read-only by yawmd.
+ *
+ * A struct per_file_header followed by n_snr * n_rate * n_len float32 frame
+ * error rates in host byte order, the length bucket varying fastest:
+ *
+ *   per[((snr - snr_min) * n_rate + column) * n_len + len / len_bucket]
+ *
+ * SNRs are integer dB. Columns 0-11 are the legacy rates of mac80211_hwsim
+ * (1 to 54 Mbps), columns 12-23 are the MCS 0-11 of HT, VHT and HE at 20 MHz.
+ * The last length bucket is used for all the longer frames. Written by
+ * per_convert from the text tables of wmediumd.
+ */
+
+#include <stdint.h>
+
+#define PER_FILE_MAGIC		0x52455059	// "YPER"
+#define PER_FILE_VERSION	1
+#define PER_FILE_LEGACY_RATES	12
+#define PER_FILE_MCS_COLUMN	PER_FILE_LEGACY_RATES
+#define PER_FILE_MAX_COLUMNS	(PER_FILE_LEGACY_RATES + 12)
+
+struct per_file_header {
+	uint32_t	magic;
+	uint32_t	version;
+	int32_t		snr_min;
+	uint32_t	n_snr;
+	uint32_t	n_rate;
+	uint32_t	n_len;
+	uint32_t	len_bucket;	// bytes, 0 if n_len == 1
+	uint32_t	reserved;
+};
+
+#endif /* YAWMD_PER_FILE_H_ */
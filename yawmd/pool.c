@@ -0,0 +1,205 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "pool.h"
+
+// smallest chunk of POOL_GUIDED
+#define POOL_MIN_CHUNK	4
+
+struct pool {
+	pthread_t		*threads;
+	unsigned int		n_threads;
+	enum pool_schedule	schedule;
+	// held by pool_run() for the whole loop
+	pthread_mutex_t		run_mutex;
+
+	pthread_mutex_t		mutex;
+	pthread_cond_t		start;	// a loop started, or .stop
+	pthread_cond_t		done;	// .running reached 0
+	unsigned long		loop;	// number of the current loop
+	unsigned int		running; // helpers still in the current loop
+	bool			stop;
+
+	// the current loop
+	pool_fn			fn;
+	void			*arg;
+	unsigned int		n;
+	_Atomic unsigned int	next;	// first iteration not taken, guided
+};
+
+struct pool_helper {
+	struct pool		*pool;
+	unsigned int		worker;
+};
+
+/* The share of the current loop of worker. */
+static void pool_work(struct pool *pool, unsigned int worker)
+{
+	unsigned int workers = pool->n_threads + 1;
+	unsigned int n = pool->n;
+
+	if (pool->schedule == POOL_STATIC) {
+		unsigned int begin = (unsigned int)
+			((unsigned long long) n * worker / workers);
+		unsigned int end = (unsigned int)
+			((unsigned long long) n * (worker + 1) / workers);
+
+		if (begin < end)
+			pool->fn(pool->arg, worker, begin, end);
+		return;
+	}
+
+	for (;;) {
+		unsigned int begin = atomic_load_explicit(&pool->next,
+							  memory_order_relaxed);
+		unsigned int chunk;
+
+		if (begin >= n)
+			return;
+		chunk = (n - begin) / (2 * workers);
+		if (chunk < POOL_MIN_CHUNK)
+			chunk = POOL_MIN_CHUNK;
+		if (chunk > n - begin)
+			chunk = n - begin;
+		if (atomic_compare_exchange_weak_explicit(&pool->next, &begin,
+				begin + chunk, memory_order_relaxed,
+				memory_order_relaxed))
+			pool->fn(pool->arg, worker, begin, begin + chunk);
+	}
+}
+
+static void *pool_main(void *arg)
+{
+	struct pool_helper *helper = arg;
+	struct pool *pool = helper->pool;
+	unsigned long loop = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->stop && pool->loop == loop)
+			pthread_cond_wait(&pool->start, &pool->mutex);
+		if (pool->stop)
+			break;
+		loop = pool->loop;
+		pthread_mutex_unlock(&pool->mutex);
+
+		pool_work(pool, helper->worker);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->running == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	free(helper);
+	return NULL;
+}
+
+/* Start n_threads helpers. Returns NULL if none could be started. */
+struct pool *pool_new(unsigned int n_threads, enum pool_schedule schedule)
+{
+	struct pool *pool = calloc(1, sizeof(struct pool));
+
+	if (pool == NULL)
+		return NULL;
+	pool->threads = calloc(n_threads, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pool->schedule = schedule;
+	pthread_mutex_init(&pool->run_mutex, NULL);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (; pool->n_threads < n_threads; pool->n_threads++) {
+		struct pool_helper *helper = malloc(sizeof(*helper));
+
+		if (helper == NULL)
+			break;
+		helper->pool = pool;
+		helper->worker = pool->n_threads;
+		if (pthread_create(&pool->threads[pool->n_threads], NULL,
+				   pool_main, helper) != 0) {
+			free(helper);
+			break;
+		}
+	}
+	if (pool->n_threads == 0) {
+		pool_free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void pool_free(struct pool *pool)
+{
+	if (pool == NULL)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->mutex);
+	for (unsigned int i = 0; i < pool->n_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_mutex_destroy(&pool->run_mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+unsigned int pool_workers(const struct pool *pool)
+{
+	return pool == NULL ? 1 : pool->n_threads + 1;
+}
+
+void pool_run(struct pool *pool, unsigned int n, pool_fn fn, void *arg)
+{
+	if (pool == NULL) {
+		if (n > 0)
+			fn(arg, 0, 0, n);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->run_mutex);
+	pthread_mutex_lock(&pool->mutex);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->n = n;
+	atomic_store_explicit(&pool->next, 0, memory_order_relaxed);
+	pool->running = pool->n_threads;
+	pool->loop++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->mutex);
+
+	// the calling thread is the last worker
+	pool_work(pool, pool->n_threads);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->running > 0)
+		pthread_cond_wait(&pool->done, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+	pthread_mutex_unlock(&pool->run_mutex);
+}
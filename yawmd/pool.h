@@ -0,0 +1,53 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+/*
+ * Helper threads for the loops whose iterations are independent, e.g. the rows
+ * of recalc_path_loss().
+ *
+ * pool_run() splits the iterations [0, n) between the helpers and the calling
+ * thread and returns when all of them are done. Several threads may call it,
+ * the loops are run one after the other.
+ */
+
+enum pool_schedule {
+	// one contiguous block of iterations per thread
+	POOL_STATIC,
+	// chunks taken on demand, decreasing in size as the loop ends
+	POOL_GUIDED,
+};
+
+// Runs the iterations [begin, end) of a loop. worker is in
+// [0, pool_workers()), and no two threads run with the same worker at once.
+typedef void (*pool_fn)(void *arg, unsigned int worker, unsigned int begin,
+			unsigned int end);
+
+struct pool;
+
+struct pool *pool_new(unsigned int n_threads, enum pool_schedule schedule);
+void pool_free(struct pool *pool);
+// the helpers and the calling thread, 1 if pool is NULL
+unsigned int pool_workers(const struct pool *pool);
+// fn(arg, 0, 0, n) in the calling thread if pool is NULL
+void pool_run(struct pool *pool, unsigned int n, pool_fn fn, void *arg);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,112 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#ifndef RING_H_
+#define RING_H_
+
+/*
+ * Bounded single-producer single-consumer ring of pointers.
+ *
+ * Exactly one thread may call spsc_ring_push() and exactly one (other) thread
+ * may call spsc_ring_pop() on the same ring. No locks are taken: the producer
+ * only writes .tail and the consumer only writes .head. The size of the ring
+ * must be a power of two.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define SPSC_RING_CACHELINE 64
+
+struct spsc_ring {
+	// consumer side
+	_Atomic size_t	head __attribute__((__aligned__(SPSC_RING_CACHELINE)));
+	// producer side
+	_Atomic size_t	tail __attribute__((__aligned__(SPSC_RING_CACHELINE)));
+	// read-only after spsc_ring_init()
+	size_t		mask __attribute__((__aligned__(SPSC_RING_CACHELINE)));
+	void		**slots;
+};
+
+/* Allocate the slots of the ring. Returns false if size is not a power of two
+or if the allocation failed. */
+static inline bool spsc_ring_init(struct spsc_ring *ring, size_t size)
+{
+	if (size == 0 || (size & (size - 1)) != 0)
+		return false;
+	ring->slots = calloc(size, sizeof(void *));
+	if (ring->slots == NULL)
+		return false;
+	ring->mask = size - 1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return true;
+}
+
+static inline void spsc_ring_free(struct spsc_ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+/* Producer only. Returns false if the ring is full. If was_empty is not NULL
+it is set to whether the consumer could have observed the ring empty before
+this element was added, i.e. if the consumer may need to be woken up. */
+static inline bool spsc_ring_push(struct spsc_ring *ring, void *elem,
+				  bool *was_empty)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail - head > ring->mask)
+		return false;
+
+	ring->slots[tail & ring->mask] = elem;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	if (was_empty != NULL) {
+		// Pairs with the fence in spsc_ring_pop(): either the consumer
+		// sees the new tail, or we see that it consumed everything.
+		atomic_thread_fence(memory_order_seq_cst);
+		head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		*was_empty = head == tail;
+	}
+	return true;
+}
+
+/* Consumer only. Returns NULL if the ring is empty. */
+static inline void *spsc_ring_pop(struct spsc_ring *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	void *elem;
+
+	if (head == tail) {
+		atomic_thread_fence(memory_order_seq_cst);
+		tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		if (head == tail)
+			return NULL;
+	}
+
+	elem = ring->slots[head & ring->mask];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return elem;
+}
+
+#endif /* RING_H_ */
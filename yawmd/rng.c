@@ -0,0 +1,133 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include "rng.h"
+
+/*
+ * Standard normal variates with the Ziggurat method of Marsaglia and Tsang
+ * (2000), 128 layers. About 99% of the draws cost one random number, a
+ * multiplication and a comparison. The layer index and the value come from
+ * different bits of the same 64 bit number, which avoids the correlation of
+ * the original 32 bit version.
+ */
+#define ZIG_LAYERS	128
+#define ZIG_R		3.442619855899		// start of the tail
+#define ZIG_V		9.91256303526217e-3	// area of each layer
+#define ZIG_M		2147483648.0		// 2^31
+
+static uint32_t zig_k[ZIG_LAYERS];
+static double zig_w[ZIG_LAYERS];
+static double zig_f[ZIG_LAYERS];
+
+void init_rng_tables(void)
+{
+	double dn = ZIG_R, tn = ZIG_R;
+	double q = ZIG_V / exp(-0.5 * dn * dn);
+
+	zig_k[0] = (uint32_t) ((dn / q) * ZIG_M);
+	zig_k[1] = 0;
+	zig_w[0] = q / ZIG_M;
+	zig_w[ZIG_LAYERS - 1] = dn / ZIG_M;
+	zig_f[0] = 1.0;
+	zig_f[ZIG_LAYERS - 1] = exp(-0.5 * dn * dn);
+
+	for (int i = ZIG_LAYERS - 2; i >= 1; i--) {
+		dn = sqrt(-2.0 * log(ZIG_V / dn + exp(-0.5 * dn * dn)));
+		zig_k[i + 1] = (uint32_t) ((dn / tn) * ZIG_M);
+		tn = dn;
+		zig_f[i] = exp(-0.5 * dn * dn);
+		zig_w[i] = dn / ZIG_M;
+	}
+}
+
+/* Outside of the rectangle of layer iz: the wedge, or the tail for layer 0. */
+static double rng_normal_slow(struct rng *rng, int32_t hz, unsigned int iz)
+{
+	for (;;) {
+		double x = hz * zig_w[iz];
+		uint64_t r;
+
+		if (iz == 0) {
+			double y;
+			do {
+				x = -log(rng_uniform_pos(rng)) / ZIG_R;
+				y = -log(rng_uniform_pos(rng));
+			} while (y + y < x * x);
+			return hz > 0 ? ZIG_R + x : -ZIG_R - x;
+		}
+		if (zig_f[iz] + rng_uniform(rng) * (zig_f[iz - 1] - zig_f[iz]) <
+		    exp(-0.5 * x * x))
+			return x;
+
+		r = rng_next(rng);
+		hz = (int32_t) (r >> 32);
+		iz = r & (ZIG_LAYERS - 1);
+		if ((uint32_t) llabs(hz) < zig_k[iz])
+			return hz * zig_w[iz];
+	}
+}
+
+double rng_normal(struct rng *rng)
+{
+	uint64_t r = rng_next(rng);
+	int32_t hz = (int32_t) (r >> 32);
+	unsigned int iz = r & (ZIG_LAYERS - 1);
+
+	if ((uint32_t) llabs(hz) < zig_k[iz])
+		return hz * zig_w[iz];
+	return rng_normal_slow(rng, hz, iz);
+}
+
+/*
+ * Advance the state by 2^128 draws. Streams taken from one seed and separated
+ * by jumps do not overlap: each medium gets its own, see configure().
+ */
+void rng_jump(struct rng *rng)
+{
+	static const uint64_t jump[] = {
+		0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+		0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+	};
+	uint64_t s[4] = { 0, 0, 0, 0 };
+
+	for (int i = 0; i < 4; i++)
+		for (int b = 0; b < 64; b++) {
+			if (jump[i] & (1ULL << b))
+				for (int k = 0; k < 4; k++)
+					s[k] ^= rng->s[k];
+			rng_next(rng);
+		}
+	for (int k = 0; k < 4; k++)
+		rng->s[k] = s[k];
+}
+
+/* Bulk versions for the paths that draw one variate per receiver. */
+void rng_fill_uniform(struct rng *rng, double *out, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+		out[i] = rng_uniform(rng);
+}
+
+void rng_fill_normal(struct rng *rng, double *out, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+		out[i] = rng_normal(rng);
+}
@@ -0,0 +1,87 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#ifndef RNG_H_
+#define RNG_H_
+
+/*
+ * xoshiro256++ pseudo random number generator (Blackman and Vigna).
+ *
+ * Unlike drand48() the state is explicit: every medium has its own struct rng
+ * and only the thread that simulates the medium draws from it, so there is no
+ * hidden shared state between the medium threads of -t.
+ */
+
+#include <stdint.h>
+
+struct rng {
+	uint64_t	s[4];
+};
+
+static inline uint64_t rng_rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+/* Initialize the state from a 64 bit seed with splitmix64, which never gives
+the all zero state. */
+static inline void rng_seed(struct rng *rng, uint64_t seed)
+{
+	for (int i = 0; i < 4; i++) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		rng->s[i] = z ^ (z >> 31);
+	}
+}
+
+static inline uint64_t rng_next(struct rng *rng)
+{
+	uint64_t *s = rng->s;
+	uint64_t result = rng_rotl(s[0] + s[3], 23) + s[0];
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rng_rotl(s[3], 45);
+	return result;
+}
+
+/* Uniform in [0, 1), a drop-in replacement of drand48(). */
+static inline double rng_uniform(struct rng *rng)
+{
+	return (double) (rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+/* Uniform in (0, 1), for logarithms. */
+static inline double rng_uniform_pos(struct rng *rng)
+{
+	return ((double) (rng_next(rng) >> 11) + 0.5) * 0x1.0p-53;
+}
+
+void rng_jump(struct rng *rng);
+void rng_fill_uniform(struct rng *rng, double *out, unsigned int n);
+double rng_normal(struct rng *rng);
+void rng_fill_normal(struct rng *rng, double *out, unsigned int n);
+void init_rng_tables(void);
+
+#endif /* RNG_H_ */
@@ -0,0 +1,226 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "vtime.h"
+
+#define VEVENT_QUEUE_INITIAL_CAPACITY 64
+
+/* Is a scheduled before b. */
+static inline bool vevent_before(struct vevent *a, struct vevent *b)
+{
+	return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+bool vevent_queue_init(struct vevent_queue *queue)
+{
+	queue->heap = malloc(sizeof(struct vevent) *
+			     VEVENT_QUEUE_INITIAL_CAPACITY);
+	if (queue->heap == NULL)
+		return false;
+	queue->capacity = VEVENT_QUEUE_INITIAL_CAPACITY;
+	queue->size = 0;
+	queue->next_seq = 0;
+	return true;
+}
+
+void vevent_queue_free(struct vevent_queue *queue)
+{
+	free(queue->heap);
+	queue->heap = NULL;
+	queue->size = 0;
+	queue->capacity = 0;
+}
+
+/* Add an event to the queue. */
+bool vevent_schedule(struct vevent_queue *queue, u64 time, int type,
+		     void *data)
+{
+	struct vevent ev = { .time = time, .seq = queue->next_seq++,
+			     .type = type, .data = data };
+	size_t i;
+
+	if (queue->size == queue->capacity) {
+		struct vevent *heap = realloc(queue->heap,
+			sizeof(struct vevent) * queue->capacity * 2);
+		if (heap == NULL)
+			return false;
+		queue->heap = heap;
+		queue->capacity *= 2;
+	}
+
+	// sift up
+	i = queue->size++;
+	while (i > 0 && vevent_before(&ev, &queue->heap[(i - 1) / 2])) {
+		queue->heap[i] = queue->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	queue->heap[i] = ev;
+	return true;
+}
+
+/* Remove the earliest event from the queue. Returns false if it is empty. */
+bool vevent_next(struct vevent_queue *queue, struct vevent *event)
+{
+	struct vevent last;
+	size_t i, child;
+
+	if (queue->size == 0)
+		return false;
+
+	*event = queue->heap[0];
+	last = queue->heap[--queue->size];
+
+	// sift down
+	i = 0;
+	while ((child = 2 * i + 1) < queue->size) {
+		if (child + 1 < queue->size &&
+		    vevent_before(&queue->heap[child + 1], &queue->heap[child]))
+			child++;
+		if (!vevent_before(&queue->heap[child], &last))
+			break;
+		queue->heap[i] = queue->heap[child];
+		i = child;
+	}
+	queue->heap[i] = last;
+	return true;
+}
+
+
+//------------------------------------------------------------------------------
+/* Trace transport */
+
+struct trace *trace_open(const char *file_name)
+{
+	struct trace *trace;
+	FILE *file = fopen(file_name, "r");
+
+	if (file == NULL) {
+		fprintf(stderr, "Cannot open trace %s: %s\n", file_name,
+			strerror(errno));
+		return NULL;
+	}
+	trace = calloc(1, sizeof(struct trace));
+	if (trace == NULL) {
+		fprintf(stderr, "Out of memory for trace %s\n", file_name);
+		fclose(file);
+		return NULL;
+	}
+	trace->file = file;
+	trace->name = file_name;
+	return trace;
+}
+
+void trace_close(struct trace *trace)
+{
+	if (trace == NULL)
+		return;
+	fclose(trace->file);
+	free(trace);
+}
+
+static bool parse_mac(const char *str, u8 *mac)
+{
+	unsigned int m[ETH_ALEN];
+
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3],
+		   &m[4], &m[5]) != ETH_ALEN)
+		return false;
+	for (unsigned int i = 0; i < ETH_ALEN; i++)
+		mac[i] = (u8) m[i];
+	return true;
+}
+
+static bool parse_rates(char *str, struct trace_record *record)
+{
+	char *save = NULL;
+	char *tok;
+
+	record->tx_rates_count = 0;
+	for (tok = strtok_r(str, ",", &save); tok != NULL;
+	     tok = strtok_r(NULL, ",", &save)) {
+		int idx, count;
+		unsigned int flags = 0;
+		if (record->tx_rates_count == IEEE80211_TX_MAX_RATES ||
+		    sscanf(tok, "%d:%d:%x", &idx, &count, &flags) < 2 ||
+		    idx < -1 || idx > 127 || count < 0 || count > 255 ||
+		    flags > 0xffff)
+			return false;
+		record->tx_rates[record->tx_rates_count].idx = (signed char) idx;
+		record->tx_rate_flags[record->tx_rates_count] = (u16) flags;
+		record->tx_rates[record->tx_rates_count].count =
+			(unsigned char) count;
+		record->tx_rates_count++;
+	}
+	return record->tx_rates_count > 0;
+}
+
+/* Read the next transmission of the trace. Returns false at the end of the
+trace or at the first invalid line. */
+bool trace_next(struct trace *trace, struct trace_record *record)
+{
+	char line[512];
+	char tx[32], rx[32], type[16], rates[128];
+	double time;
+
+	while (fgets(line, sizeof(line), trace->file) != NULL) {
+		trace->line++;
+		char *p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		if (sscanf(p, "%lf %31s %31s %15s %u %u %u %127s", &time, tx,
+			   rx, type, &record->frame_len, &record->freq,
+			   &record->flags, rates) != 8 ||
+		    !parse_mac(tx, record->transmitter) ||
+		    !parse_mac(rx, record->receiver) ||
+		    !parse_rates(rates, record) || time < 0.0) {
+			fprintf(stderr, "Invalid trace record (%s:%u)\n",
+				trace->name, trace->line);
+			return false;
+		}
+
+		record->tid = -1;
+		if (strcmp(type, "mgmt") == 0) {
+			record->frame_control = FTYPE_MGMT;
+		} else if (strcmp(type, "data") == 0) {
+			record->frame_control = FTYPE_DATA;
+		} else if (sscanf(type, "qos:%d", &record->tid) == 1 &&
+			   record->tid >= 0 && record->tid < 8) {
+			record->frame_control = FTYPE_DATA | STYPE_QOS_DATA;
+		} else {
+			fprintf(stderr, "Invalid frame type \"%s\" (%s:%u)\n",
+				type, trace->name, trace->line);
+			return false;
+		}
+
+		record->time = (u64) (time * 1E9);
+		if (record->time < trace->last_time) {
+			fprintf(stderr, "Trace records must be in time order "
+				"(%s:%u)\n", trace->name, trace->line);
+			return false;
+		}
+		trace->last_time = record->time;
+		return true;
+	}
+	return false;
+}
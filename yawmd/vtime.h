@@ -0,0 +1,111 @@
+/*
+ *	yawmd, wireless medium simulator for the Linux module mac80211_hwsim
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version 2
+ *	of the License, or (at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *	02110-1301, USA.
+ */
+
+#ifndef YAWMD_VTIME_H_
+#define YAWMD_VTIME_H_
+
+#include <stdio.h>
+#include "yawmd.h"
+
+/*
+ * Virtual time mode (-r).
+ *
+ * Instead of waiting on timerfds, every timer of the simulation becomes an
+ * event in a global queue ordered by (time, insertion order), and the clock
+ * jumps to the next event. Frames are read from a trace file instead of
+ * netlink, so the simulation runs as fast as the CPU allows and two runs of
+ * the same trace process the same events in the same order.
+ */
+
+enum vevent_type {
+	VEVENT_INGEST,		// .data is a struct frame read from the trace
+	VEVENT_DELIVERY,	// .data is the struct channel
+	VEVENT_MOVE,		// tick of yawmd.mclock, .data is NULL
+};
+
+struct vevent {
+	u64		time;	// nanoseconds of virtual time
+	u64		seq;	// insertion order, breaks ties
+	int		type;
+	void		*data;
+};
+
+/* Binary min-heap of struct vevent. */
+struct vevent_queue {
+	struct vevent	*heap;
+	size_t		size;
+	size_t		capacity;
+	u64		next_seq;
+};
+
+bool vevent_queue_init(struct vevent_queue *queue);
+void vevent_queue_free(struct vevent_queue *queue);
+bool vevent_schedule(struct vevent_queue *queue, u64 time, int type,
+		     void *data);
+bool vevent_next(struct vevent_queue *queue, struct vevent *event);
+
+static inline u64 timespec_to_ns(const struct timespec *t)
+{
+	return (u64) t->tv_sec * 1000000000ULL + (u64) t->tv_nsec;
+}
+
+static inline void ns_to_timespec(u64 ns, struct timespec *t)
+{
+	t->tv_sec = ns / 1000000000ULL;
+	t->tv_nsec = ns % 1000000000ULL;
+}
+
+/*
+ * Trace transport. One transmission per line, in non-decreasing time order:
+ *
+ * <time [s]> <transmitter> <receiver> <type> <length> <freq> <flags> <rates>
+ *
+ *   type:  mgmt | data | qos:<tid>
+ *   flags: mac80211_hwsim HWSIM_TX_CTL_* flags
+ *   rates: <idx>:<count>[:<rc flags>][,...] (at most IEEE80211_TX_MAX_RATES),
+ *          rc flags in hexadecimal, HWSIM_TX_RC_* flags of the rate
+ *
+ * Empty lines and lines starting with '#' are ignored.
+ */
+struct trace_record {
+	u64			time;	// nanoseconds
+	u8			transmitter[ETH_ALEN];
+	u8			receiver[ETH_ALEN];
+	u8			frame_control;
+	int			tid;	// -1 if not QoS data
+	unsigned int		frame_len;
+	u32			freq;
+	unsigned int		flags;
+	int			tx_rates_count;
+	struct hwsim_tx_rate	tx_rates[IEEE80211_TX_MAX_RATES];
+	u16			tx_rate_flags[IEEE80211_TX_MAX_RATES];
+};
+
+struct trace {
+	FILE		*file;
+	const char	*name;
+	unsigned int	line;
+	u64		last_time;
+};
+
+struct trace *trace_open(const char *file_name);
+void trace_close(struct trace *trace);
+bool trace_next(struct trace *trace, struct trace_record *record);
+
+#endif /* YAWMD_VTIME_H_ */
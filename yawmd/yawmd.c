@@ -32,6 +32,8 @@
 #include <signal.h>
 #include <math.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sched.h>
 #include <errno.h>
 #include <limits.h>
 #include <unistd.h>
@@ -42,6 +44,7 @@
 #include "yawmd.h"
 #include "ieee80211.h"
 #include "config.h"
+#include "vtime.h"
 // #include "yserver.h"
 // #include "config_dynamic.h"
 // #include "yserver_messages.h"
@@ -49,18 +52,7 @@
 // See main()
 struct itimerspec it_1ns;
 
-/* Integer round up division. For example 1.1 gets rounded to 2. */
-static inline int div_round(int a, int b)
-{
-	return (a + b - 1) / b;
-}
-
-/* Calculate frame transmission duration. */
-static inline int pkt_duration(int len, int rate)
-{
-	/* preamble + signal + t_sym * n_sym, rate in 100 kbps */
-	return 16 + 4 + 4 * div_round((16 + 8 * len + 6) * 10, 4 * rate);
-}
+static void deliver_frame(struct medium *medium, struct frame *frame);
 
 /* Log to stdout if level <= ctx->log_lvl. */
 int w_logf(struct yawmd *ctx, u8 level, const char *format, ...)
@@ -109,6 +101,17 @@ static void timespec_add_seconds(struct timespec *t, double seconds) {
 	t->tv_nsec = (long) (ns % (long) 1E9);
 }
 
+/* t + usec of simulated time, in real time according to the time dilation
+factor. */
+static void timespec_add_sim_usec(struct yawmd *ctx, struct timespec *t,
+				  int usec)
+{
+	if (ctx->time_dilation == 1.0)
+		timespec_add_usec(t, usec);
+	else
+		timespec_add_seconds(t, usec / 1E6 / ctx->time_dilation);
+}
+
 /* c = a - b */
 static int timespec_sub(struct timespec *a, struct timespec *b,
 			struct timespec *c)
@@ -126,6 +129,108 @@ static int timespec_sub(struct timespec *a, struct timespec *b,
 }
 
 
+//------------------------------------------------------------------------------
+/* Simulation clock and timers */
+
+/* Current time of the simulation: the monotonic clock, or the virtual clock in
+virtual time mode. */
+static void sim_clock_now(struct yawmd *ctx, struct timespec *now)
+{
+	if (ctx->virtual_time)
+		*now = ctx->vnow;
+	else
+		clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+/* Set the delivery timer of the channel to expire at .end_transmission. There
+is at most one delivery pending per channel: the timer is only set when there
+is no current transmission or after it expired. */
+static void set_delivery_timer(struct channel *channel)
+{
+	struct yawmd *ctx = channel->medium->ctx;
+
+	if (ctx->virtual_time) {
+		vevent_schedule(ctx->vevents,
+				timespec_to_ns(&channel->end_transmission),
+				VEVENT_DELIVERY, channel);
+		ctx->vframes++;
+		return;
+	}
+
+	struct itimerspec timer;
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value = channel->end_transmission;
+	timerfd_settime(channel->delivery_timerfd, TFD_TIMER_ABSTIME, &timer,
+			NULL);
+}
+
+/* Set the timer of the mobility clock to expire at its next tick. */
+static void set_mobility_timer(struct yawmd *ctx)
+{
+	if (ctx->virtual_time) {
+		vevent_schedule(ctx->vevents,
+				timespec_to_ns(&ctx->mclock.next.it_value),
+				VEVENT_MOVE, NULL);
+		return;
+	}
+
+	timerfd_settime(ctx->mclock.timerfd, TFD_TIMER_ABSTIME,
+			&ctx->mclock.next, NULL);
+}
+
+/* Set the own movement timer of the medium to expire at .move_time. */
+static void set_move_timer(struct medium *medium)
+{
+	timerfd_settime(medium->move_timerfd, TFD_TIMER_ABSTIME,
+			&medium->move_time, NULL);
+}
+
+
+//------------------------------------------------------------------------------
+/* Channels of a medium */
+
+static void delivery_timer_cb(int fd, short what, void *data);
+
+static void wqueue_init(struct wqueue *wqueue, int cw_min, int cw_max)
+{
+	INIT_LIST_HEAD(&wqueue->frames);
+	wqueue->cw_min = cw_min;
+	wqueue->cw_max = cw_max;
+}
+
+/* Find the channel of the medium for the frequency freq. It is created the
+first time a frame is sent on that frequency, so that only the frequencies
+actually used have queues and a delivery timer. */
+static struct channel *get_channel(struct medium *medium, u32 freq)
+{
+	struct channel *channel;
+
+	list_for_each_entry(channel, &medium->channels, list)
+		if (channel->freq == freq)
+			return channel;
+
+	channel = calloc(1, sizeof(struct channel));
+	if (channel == NULL)
+		return NULL;
+	channel->medium = medium;
+	channel->freq = freq;
+	wqueue_init(&channel->qos_queues[IEEE80211_AC_BK], 15, 1023);
+	wqueue_init(&channel->qos_queues[IEEE80211_AC_BE], 15, 1023);
+	wqueue_init(&channel->qos_queues[IEEE80211_AC_VI], 7, 15);
+	wqueue_init(&channel->qos_queues[IEEE80211_AC_VO], 3, 7);
+
+	if (!medium->ctx->virtual_time) {
+		channel->delivery_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+		event_assign(&channel->delivery_event, medium->ev_base,
+			     channel->delivery_timerfd, EV_READ | EV_PERSIST,
+			     delivery_timer_cb, channel);
+		event_add(&channel->delivery_event, NULL);
+	}
+	list_add_tail(&channel->list, &medium->channels);
+	return channel;
+}
+
+
 //------------------------------------------------------------------------------
 /* struct recv_container manipulation procedures */
 
@@ -311,6 +416,120 @@ static struct interface *get_interface(struct yawmd *ctx, u8 *mac_addr)
 	return NULL;
 }
 
+/* Update the overload state of the medium after a change of the lateness or of
+the queue depth. */
+static void update_overload(struct medium *medium)
+{
+	struct overload_control *ovl = &medium->overload;
+	bool overloaded =
+		(ovl->max_lateness_usec > 0 &&
+		 medium->stats.lateness_usec > ovl->max_lateness_usec) ||
+		(ovl->max_queue > 0 &&
+		 medium->stats.queue_depth > ovl->max_queue);
+
+	if (overloaded == ovl->overloaded)
+		return;
+	ovl->overloaded = overloaded;
+	if (overloaded)
+		w_flogf(medium->ctx, LOG_WARNING, stderr,
+			"Medium %d overloaded: lateness %ld us, %u frames "
+			"queued\n", medium->id, medium->stats.lateness_usec,
+			medium->stats.queue_depth);
+	else
+		w_flogf(medium->ctx, LOG_WARNING, stderr,
+			"Medium %d no longer overloaded (%lu frames rejected)\n",
+			medium->id, medium->stats.frames_overload);
+}
+
+/* Admission control. Returns false if the frame must not be transmitted
+because of the overload policy of the medium. */
+static bool admit_frame(struct medium *medium, int ac)
+{
+	if (!medium->overload.overloaded)
+		return true;
+
+	switch (medium->overload.policy) {
+	case OVERLOAD_DROP_BEST_EFFORT:
+		return ac != IEEE80211_AC_BE && ac != IEEE80211_AC_BK;
+	case OVERLOAD_NOT_ACKED:
+		return false;
+	case OVERLOAD_LOG:
+	default:
+		return true;
+	}
+}
+
+/*
+ * Number of attempts at one rate of the MRR chain until the first acked one,
+ * drawn with a single random number: a geometric variable of success
+ * probability 1 - error_prob, P(attempts > k) = error_prob^k, the same as
+ * count independent draws of the per-attempt loop of queue_frame(). Returns
+ * count + 1 if the count attempts fail.
+ */
+static int sample_attempts(struct rng *rng, double error_prob, int count)
+{
+	double k;
+
+	if (error_prob <= 0.0)
+		return 1;
+	if (error_prob >= 1.0)
+		return count + 1;
+
+	k = floor(log(rng_uniform_pos(rng)) / log(error_prob));
+	return k >= count ? count + 1 : (int) k + 1;
+}
+
+/* Backoff of n retransmissions, the contention window *cw doubling up to
+cw_max. Once the window is at cw_max the remaining ones take the same time. */
+static int backoff_time(int *cw, int n, int cw_max, int slot_time)
+{
+	int time = 0;
+
+	for (; n > 0 && *cw < cw_max; n--) {
+		time += (*cw * slot_time) / 2;
+		*cw = (*cw << 1) + 1;
+		if (*cw > cw_max)
+			*cw = cw_max;
+	}
+	return time + n * ((*cw * slot_time) / 2);
+}
+
+/* Cache entry of the link from sender to receiver, with the SNR of the link.
+Each transmitter has medium->link_cache_size slots, indexed by the receiver.
+NULL without link cache (see configure()) or on allocation failure. */
+static struct link_cache_entry *link_cache_get(struct medium *medium,
+					       struct interface *sender,
+					       struct interface *receiver)
+{
+	struct link_cache_entry **row, *e;
+
+	if (medium->link_cache_size == 0)
+		return NULL;
+	if (medium->link_cache == NULL) {
+		medium->link_cache = calloc(medium->n_interfaces,
+					    sizeof(*medium->link_cache));
+		if (medium->link_cache == NULL)
+			return NULL;
+	}
+	row = &medium->link_cache[sender->index];
+	if (*row == NULL) {
+		*row = calloc(medium->link_cache_size, sizeof(**row));
+		if (*row == NULL)
+			return NULL;
+	}
+
+	e = &(*row)[receiver->index & (medium->link_cache_size - 1)];
+	if (e->epoch == medium->link_epoch && e->rx == receiver->index) {
+		medium->stats.link_cache_hits++;
+		return e;
+	}
+	medium->stats.link_cache_misses++;
+	e->rx = receiver->index;
+	e->epoch = medium->link_epoch;
+	e->snr = medium->get_link_snr(medium, sender, receiver);
+	return e;
+}
+
 /* Find appropriate QoS queue, determine delivery timestamp of the frame and
 reset timer. */
 static void queue_frame(struct frame *frame)
@@ -321,26 +540,23 @@ static void queue_frame(struct frame *frame)
 	struct interface *sender = frame->sender;
 	struct interface *receiver;
 	struct medium *medium = sender->medium;
+	struct channel *channel;
+	struct link_cache_entry *link = NULL;
 	int send_time;
 	int cw;
 	double error_prob;
 	bool is_acked = false;
 	bool noack = false;
 	int i, j;
-	int rate_idx;
 	int ac;
 
-	/* TODO configure phy parameters */
-	int slot_time = 9;
-	int sifs = 16;
-	int difs = 2 * slot_time + sifs;
+	int slot_time = medium->phy.slot_time;
+	int difs = medium->phy.difs;
+	int ack_time_usec = medium->phy.ack_time[frame->freq > 5000];
 
 	int retries = 0;
 
-	clock_gettime(CLOCK_MONOTONIC, &now);
-
-	int ack_time_usec =
-		pkt_duration(14, index_to_rate(0, frame->freq)) + sifs;
+	sim_clock_now(medium->ctx, &now);
 
 	/*
 	 * To determine a frame's expiration time, we compute the
@@ -350,7 +566,28 @@ static void queue_frame(struct frame *frame)
 	 */
 
 	ac = frame_select_queue_80211(frame);
-	queue = &medium->qos_queues[ac];
+	channel = get_channel(medium, frame->freq);
+
+	medium->stats.frames_in++;
+	if (channel == NULL) {
+		w_flogf(medium->ctx, LOG_ERR, stderr,
+			"Unable to allocate channel %u of medium %d\n",
+			frame->freq, medium->id);
+		// reported as not acked, like a rejected frame
+		frame->signal = medium->noise_level;
+		frame->duration = 0;
+		deliver_frame(medium, frame);
+		return;
+	}
+	if (!admit_frame(medium, ac)) {
+		// Reported right away, without using the medium.
+		medium->stats.frames_overload++;
+		frame->signal = medium->noise_level;
+		frame->duration = 0;
+		deliver_frame(medium, frame);
+		return;
+	}
+	queue = &channel->qos_queues[ac];
 
 	/* try to "send" this frame at each of the rates in the rateset */
 	send_time = 0;
@@ -362,7 +599,11 @@ static void queue_frame(struct frame *frame)
 		receiver = NULL;
 	} else {
 		receiver = get_interface_medium(medium, dest);
-		if (receiver) {
+		if (receiver)
+			link = link_cache_get(medium, sender, receiver);
+		if (link) {
+			snr = link->snr;
+		} else if (receiver) {
 			snr = medium->get_link_snr(medium, sender, receiver);
 			// snr -= get_signal_offset_by_interference(medium,
 			// 		sender->index, receiver->index);
@@ -376,19 +617,44 @@ static void queue_frame(struct frame *frame)
 	// Find appropriate transmission rate by applying error fails until the
 	// frame is acked. Also simulates the transmission time.
 	for (i = 0; i < frame->tx_rates_count && !is_acked; i++) {
-		rate_idx = frame->tx_rates[i].idx;
+		u32 rate;
+		int duration;
 
 		/* no more rates in MRR */
-		if (rate_idx < 0)
+		if (frame->tx_rates[i].idx < 0)
 			break;
 
+		rate = hwsim_rate_code(frame->tx_rates[i].idx,
+				       frame->tx_rate_flags[i]);
+		duration = rate_duration(rate, frame->freq, frame->frame_len);
+		// with a per_cache, frames of the same SNR, rate and length skip
+		// the calculation
 		error_prob =
-			medium->get_error_prob(medium, snr, rate_idx,
+			medium->get_error_prob(medium, snr, rate,
 					       frame->freq, frame->frame_len,
 					       sender, receiver);
+
+		if (medium->ctx->geometric_retries && !noack) {
+			int count = frame->tx_rates[i].count;
+			int attempts = sample_attempts(&medium->rng,
+						       error_prob, count);
+			int n = min(attempts, count);
+
+			if (n > 0)
+				send_time += n * (difs + duration +
+						  ack_time_usec) +
+					     backoff_time(&cw, n - 1,
+							  queue->cw_max,
+							  slot_time);
+			retries += n;
+			is_acked = attempts <= count;
+			// j as left by the per-attempt loop
+			j = is_acked ? attempts : count;
+			continue;
+		}
+
 		for (j = 0; j < frame->tx_rates[i].count && !is_acked; j++) {
-			send_time += difs + pkt_duration(frame->frame_len,
-				index_to_rate(rate_idx, frame->freq));
+			send_time += difs + duration;
 
 			retries++;
 
@@ -408,7 +674,7 @@ static void queue_frame(struct frame *frame)
 					cw = queue->cw_max;
 			}
 
-			if (drand48() > error_prob)
+			if (rng_uniform(&medium->rng) > error_prob)
 				is_acked = true;
 
 			send_time += ack_time_usec;
@@ -426,21 +692,23 @@ static void queue_frame(struct frame *frame)
 	frame->duration = send_time;
 	/* See deliver_queued_frames() for more details. */
 	// If there is no current transmission, start sending now.
-	if (medium->current_transmission == NULL) {
-		medium->end_transmission = now;
-		medium->current_transmission = frame;
-		timespec_add_usec(&medium->end_transmission, frame->duration);
+	if (channel->current_transmission == NULL) {
+		channel->end_transmission = now;
+		channel->current_transmission = frame;
+		timespec_add_sim_usec(medium->ctx, &channel->end_transmission,
+				      frame->duration);
 
 		/* Frames are only sent to mac80211_hwsim after they finish
 		being transmitted in the medium. */
-		struct itimerspec timer;
-		memset(&timer, 0, sizeof(timer));
-		timer.it_value = medium->end_transmission;
-		timerfd_settime(medium->delivery_timerfd, TFD_TIMER_ABSTIME,
-				&timer, NULL);
+		set_delivery_timer(channel);
 	}
 	else {
 		list_add_tail(&frame->list, &queue->frames);
+		medium->stats.queue_depth++;
+		if (medium->stats.queue_depth > medium->stats.max_queue_depth)
+			medium->stats.max_queue_depth =
+				medium->stats.queue_depth;
+		update_overload(medium);
 	}
 }
 
@@ -504,7 +772,162 @@ out:
 	return ret;
 }
 
-/* Fill the frame receiver's list. */
+/* Wake up the consumer of a pipeline ring. */
+static void pipeline_notify(int efd)
+{
+	uint64_t u = 1;
+	ssize_t ret;
+
+	do
+		ret = write(efd, &u, sizeof(u));
+	while (ret < 0 && errno == EINTR);
+	// EAGAIN means the counter is saturated: the consumer has not read it
+	// yet and will wake up anyway
+	if (ret < 0 && errno != EAGAIN)
+		fprintf(stderr, "Error notifying a pipeline stage: %s\n",
+			strerror(errno));
+}
+
+/* Add a frame to a pipeline ring and wake up its consumer if it may be idle.
+If the ring is full the producer waits for the consumer to make room, which
+propagates the back pressure to the previous stage. */
+static void pipeline_push(struct spsc_ring *ring, int efd, struct frame *frame)
+{
+	bool was_empty;
+
+	while (!spsc_ring_push(ring, frame, &was_empty))
+		sched_yield();
+	if (was_empty)
+		pipeline_notify(efd);
+}
+
+/* The ingest ring filled up while the main thread receives a batch of frames,
+in sock_event_cb(). Wake up the simulation stage to drain it, and give the
+socket to the egress stage meanwhile: the simulation stage may itself be
+waiting for room in the egress ring. The receive in progress keeps its buffer
+to itself and a send only takes the next sequence number of the socket. */
+static void pipeline_ingest_wait(struct yawmd *ctx)
+{
+	struct pipeline *pipe = ctx->pipe;
+
+	if (pipe->ingest_pending) {
+		pipe->ingest_pending = false;
+		pipeline_notify(pipe->ingest_efd);
+	}
+	pthread_mutex_unlock(&pipe->socket_mutex);
+	sched_yield();
+	pthread_mutex_lock(&pipe->socket_mutex);
+}
+
+/* Allocate the scratch space of the multicast receivers of the medium. */
+static bool init_mcast_batch(struct medium *medium)
+{
+	struct mcast_batch *b = &medium->mcast;
+	unsigned int n = medium->n_interfaces;
+
+	if (b->itf != NULL)
+		return true;
+	b->itf = malloc(n * sizeof(unsigned int));
+	b->snr = malloc(n * sizeof(int));
+	b->prob = malloc(n * sizeof(double));
+	b->rand = malloc(n * sizeof(double));
+	b->lost = malloc(n * sizeof(bool));
+	if (medium->lazy_links)
+		b->rx = malloc(n * sizeof(unsigned int));
+	if (b->itf && b->snr && b->prob && b->rand && b->lost &&
+	    (b->rx != NULL || !medium->lazy_links))
+		return true;
+	free(b->rx);
+	free(b->itf);
+	free(b->snr);
+	free(b->prob);
+	free(b->rand);
+	free(b->lost);
+	memset(b, 0, sizeof(*b));
+	return false;
+}
+
+/* Same as the multicast case of deliver_frame(), but the error probabilities
+and the losses of all the receivers are evaluated at once with
+medium->get_error_prob_batch(). With struct snr_lists only the list of the
+sender is visited, with model.lazy_links and a spatial grid only the interfaces
+within range. Returns the number of receivers above the CCA threshold. */
+static unsigned int deliver_multicast_batch(struct medium *medium,
+					    struct frame *frame,
+					    struct recv_container *recv_info)
+{
+	struct mcast_batch *b = &medium->mcast;
+	const struct snr_lists *lists = medium->snr_lists;
+	u8 *src = frame->sender->addr;
+	unsigned int n = 0;
+	// the receivers: all the interfaces, the list of the sender or those
+	// within range
+	const unsigned int *rx = NULL;
+	const int *rx_snr = NULL;
+	unsigned int n_rx = medium->n_interfaces;
+
+	if (lists != NULL && lists->absent_unheard) {
+		unsigned int first = lists->rows.start[frame->sender->index];
+
+		rx = lists->rows.rx + first;
+		rx_snr = lists->rows.snr + first;
+		n_rx = lists->rows.start[frame->sender->index + 1] - first;
+	} else if (medium->lazy_links && medium->grid != NULL) {
+		n_rx = row_receivers(medium, frame->sender->index, b->rx);
+		rx = b->rx;
+	}
+
+	// the fading of every receiver at once, see get_fading_signal()
+	if (medium->fading_coefficient != 0)
+		rng_fill_normal(&medium->rng, b->rand, n_rx);
+
+	for (unsigned int k = 0; k < n_rx; k++) {
+		unsigned int i = rx == NULL ? k : rx[k];
+		struct interface *itf = &medium->interfaces[i];
+		int snr;
+
+		if (memcmp(src, itf->addr, ETH_ALEN) == 0)
+			continue;
+		if (rx_snr != NULL)
+			snr = rx_snr[k];
+		else
+			snr = medium->get_link_snr(medium, frame->sender, itf);
+		if (medium->grid != NULL && snr <= medium->grid->unreachable_snr)
+			continue;
+		if (medium->fading_coefficient != 0)
+			snr += (int) ((double) medium->fading_coefficient *
+				      b->rand[k]);
+		if (snr + medium->noise_level < DEFAULT_CCA_THRESHOLD)
+			continue;
+		b->itf[n] = i;
+		b->snr[n] = snr;
+		n++;
+	}
+	if (n == 0)
+		return 0;
+
+	medium->get_error_prob_batch(medium, b->snr, n,
+				     hwsim_rate_code(frame->tx_rates[0].idx,
+						     frame->tx_rate_flags[0]),
+				     frame->freq, frame->frame_len, b->prob);
+	rng_fill_uniform(&medium->rng, b->rand, n);
+	draw_losses_batch(b->prob, b->rand, b->lost, n);
+
+	for (unsigned int k = 0; k < n; k++) {
+		struct interface *itf = &medium->interfaces[b->itf[k]];
+		if (b->lost[k]) {
+			w_logf(medium->ctx, LOG_INFO, "Dropped mcast from "
+			       MAC_FMT " to " MAC_FMT " at receiver\n",
+			       MAC_ARGS(src), MAC_ARGS(itf->addr));
+			continue;
+		}
+		add_recv_info(recv_info, itf->hwaddr, frame->signal);
+	}
+	return n;
+}
+
+/* Fill the frame receiver's list, and send it to mac80211_hwsim. The frame is
+freed (or handed to the egress stage). */
 static void deliver_frame(struct medium *medium, struct frame *frame)
 {
 	struct yawmd *ctx = medium->ctx;
@@ -515,7 +938,13 @@ static void deliver_frame(struct medium *medium, struct frame *frame)
 	create_recv_container(&recv_info, medium);
 
 	// if simulation determined that this frame was successfully delivered
-	if (frame->flags & HWSIM_TX_STAT_ACK) {
+	if ((frame->flags & HWSIM_TX_STAT_ACK) &&
+	    is_multicast_ether_addr(dest) &&
+	    medium->get_error_prob_batch != NULL && init_mcast_batch(medium)) {
+		if (deliver_multicast_batch(medium, frame, &recv_info) > 0)
+			rate_idx = frame->tx_rates[0].idx;
+	}
+	else if (frame->flags & HWSIM_TX_STAT_ACK) {
 		/* rx the frame on the dest interface */
 		for (unsigned int i = 0; i < medium->n_interfaces; i++) {
 			struct interface *itf = &medium->interfaces[i];
@@ -530,6 +959,11 @@ static void deliver_frame(struct medium *medium, struct frame *frame)
 				 */
 				snr = medium->get_link_snr(medium, frame->sender,
 							   itf);
+				// out of range of the spatial grid, no fading
+				// is enough
+				if (medium->grid != NULL &&
+				    snr <= medium->grid->unreachable_snr)
+					continue;
 				snr += get_fading_signal(medium);
 				signal = snr + medium->noise_level;
 				if (signal < DEFAULT_CCA_THRESHOLD)
@@ -548,10 +982,13 @@ static void deliver_frame(struct medium *medium, struct frame *frame)
 
 				rate_idx = frame->tx_rates[0].idx;
 				error_prob = medium->get_error_prob(medium,
-					(double)snr, rate_idx, frame->freq,
-					frame->frame_len, frame->sender, itf);
+					(double)snr,
+					hwsim_rate_code(rate_idx,
+							frame->tx_rate_flags[0]),
+					frame->freq, frame->frame_len,
+					frame->sender, itf);
 
-				if (drand48() <= error_prob) {
+				if (rng_uniform(&medium->rng) <= error_prob) {
 					w_logf(ctx, LOG_INFO,
 					       "Dropped mcast from " MAC_FMT
 					       " to " MAC_FMT " at receiver\n",
@@ -588,30 +1025,59 @@ static void deliver_frame(struct medium *medium, struct frame *frame)
 	// 				  frame->duration, frame->signal);
 	// }
 
-	send_rx_info_nl(ctx, frame, rate_idx, &recv_info);
+	if (ctx->pipeline) {
+		// The egress thread sends the message and frees the frame.
+		frame->rx_rate_idx = rate_idx;
+		frame->recv_info = recv_info;
+		pipeline_push(&ctx->pipe->egress, ctx->pipe->egress_efd, frame);
+		return;
+	}
+
+	ctx->send_rx_info(ctx, frame, rate_idx, &recv_info);
 
 	delete_container(&recv_info);
+	free(frame);
 }
 
 /* Find the highest priority frame queued and remove it from the queue. */
-static inline struct frame * next_frame(struct medium *medium)
+static inline struct frame * next_frame(struct channel *channel)
 {
 	struct frame *frame = NULL;
 	for (unsigned int i = 0; i < IEEE80211_NUM_ACS; i++) {
-		frame = list_first_entry_or_null(&medium->qos_queues[i].frames,
+		frame = list_first_entry_or_null(&channel->qos_queues[i].frames,
 						 struct frame, list);
 		if (frame != NULL) {
 			list_del(&frame->list);
+			channel->medium->stats.queue_depth--;
 			break;
 		}
 	}
 	return frame;
 }
 
-/* Deliver the frame that finished being transmitted and all the frames that
-should already have been transmitted. Set the timer for the end of transmission
-of the next frame. */
-static void deliver_queued_frames(struct medium *medium)
+/* Account the lateness of the delivery of the current transmission of the
+channel, which should have happened at .end_transmission. */
+static void account_delivery(struct channel *channel, struct timespec *now)
+{
+	struct medium *medium = channel->medium;
+	struct timespec late;
+
+	medium->stats.frames_delivered++;
+	if (timespec_before(now, &channel->end_transmission)) {
+		medium->stats.lateness_usec = 0;
+		return;
+	}
+	timespec_sub(now, &channel->end_transmission, &late);
+	medium->stats.lateness_usec = late.tv_sec * 1000000 +
+				      late.tv_nsec / 1000;
+	if (medium->stats.lateness_usec > medium->stats.max_lateness_usec)
+		medium->stats.max_lateness_usec = medium->stats.lateness_usec;
+}
+
+/* Deliver the frame that finished being transmitted on the channel and all
+the frames that should already have been transmitted. Set the timer for the end
+of transmission of the next frame. */
+static void deliver_queued_frames(struct channel *channel)
 {
 	/* Frames are only sent to mac80211_hwsim after they finish being
 	transmitted.*/
@@ -643,41 +1109,48 @@ static void deliver_queued_frames(struct medium *medium)
 	a ctx.end_transmission before the current timestamp (now), are sent
 	without making use of the timer (ctx.timerfd). The timer is only set,
 	when ctx.end_transmission is later than the variable now.
+	All of this state is kept per channel (struct channel): frames on
+	different frequencies of the medium do not wait for each other.
 	*/
 	
+	struct medium *medium = channel->medium;
 	struct timespec now;
-	clock_gettime(CLOCK_MONOTONIC, &now);
+	sim_clock_now(medium->ctx, &now);
 
 	// Deliver the frame that finished being transmitted.
-	deliver_frame(medium, medium->current_transmission);
-	free(medium->current_transmission);
+	account_delivery(channel, &now);
+	deliver_frame(medium, channel->current_transmission);
 
-	medium->current_transmission = next_frame(medium);
+	channel->current_transmission = next_frame(channel);
 
-	if (medium->current_transmission == NULL)
+	if (channel->current_transmission == NULL) {
+		medium->stats.lateness_usec = 0;
+		update_overload(medium);
 		return;
+	}
 
 	// Transmit all the frames delayed.
 	do {
-		timespec_add_usec(&medium->end_transmission,
-				  medium->current_transmission->duration);
+		timespec_add_sim_usec(medium->ctx, &channel->end_transmission,
+				      channel->current_transmission->duration);
 		// If the end of delivery time is in the future set timer instead
-		if (!timespec_before(&medium->end_transmission, &now))
+		if (!timespec_before(&channel->end_transmission, &now))
 			break;
-		deliver_frame(medium, medium->current_transmission);
-		free(medium->current_transmission);
-		medium->current_transmission = next_frame(medium);
-	} while (medium->current_transmission != NULL
-		 && timespec_before(&medium->end_transmission, &now));
-
-	if (medium->current_transmission == NULL)
+		account_delivery(channel, &now);
+		deliver_frame(medium, channel->current_transmission);
+		channel->current_transmission = next_frame(channel);
+	} while (channel->current_transmission != NULL
+		 && timespec_before(&channel->end_transmission, &now));
+
+	// An empty queue means the channel caught up with the clock.
+	if (channel->current_transmission == NULL)
+		medium->stats.lateness_usec = 0;
+	update_overload(medium);
+
+	if (channel->current_transmission == NULL)
 		return;
 	
-	struct itimerspec timer;
-	memset(&timer, 0, sizeof(timer));
-	timer.it_value = medium->end_transmission;
-	timerfd_settime(medium->delivery_timerfd, TFD_TIMER_ABSTIME, &timer,
-			NULL);
+	set_delivery_timer(channel);
 }
 
 // static void deliver_expired_frames(struct medium *medium)
@@ -786,8 +1259,30 @@ static int process_messages_cb(struct nl_msg *msg, void *arg)
 				tx_rates_len / sizeof(struct hwsim_tx_rate);
 			memcpy(frame->tx_rates, tx_rates,
 			       min(tx_rates_len, sizeof(frame->tx_rates)));
+			memset(frame->tx_rate_flags, 0,
+			       sizeof(frame->tx_rate_flags));
+			if (attrs[HWSIM_ATTR_TX_INFO_FLAGS]) {
+				struct hwsim_tx_rate_flag *rate_flags =
+					nla_data(attrs[HWSIM_ATTR_TX_INFO_FLAGS]);
+				unsigned int n = min(
+					nla_len(attrs[HWSIM_ATTR_TX_INFO_FLAGS]) /
+					sizeof(struct hwsim_tx_rate_flag),
+					IEEE80211_TX_MAX_RATES);
+				for (unsigned int i = 0; i < n; i++)
+					frame->tx_rate_flags[i] =
+						rate_flags[i].flags;
+			}
 			
-			if (ctx->threads) {
+			if (ctx->pipeline) {
+				bool was_empty;
+				// The simulation thread is woken up once for
+				// the whole batch, see sock_event_cb().
+				while (!spsc_ring_push(&ctx->pipe->ingest,
+						       frame, &was_empty))
+					pipeline_ingest_wait(ctx);
+				ctx->pipe->ingest_pending |= was_empty;
+			}
+			else if (ctx->threads) {
 				struct medium *medium = sender->medium;
 				pthread_mutex_lock(&medium->queue_mutex);
 				list_add_tail(&frame->list, &medium->frame_queue);
@@ -861,7 +1356,11 @@ int send_register_msg(struct yawmd *ctx)
 		goto out;
 	}
 
+	if (ctx->pipe != NULL)
+		pthread_mutex_lock(&ctx->pipe->socket_mutex);
 	ret = nl_send_auto_complete(sock, msg);
+	if (ctx->pipe != NULL)
+		pthread_mutex_unlock(&ctx->pipe->socket_mutex);
 	if (ret < 0) {
 		w_logf(ctx, LOG_ERR, "%s: nl_send_auto failed\n", __func__);
 		ret = -1;
@@ -878,7 +1377,16 @@ static void sock_event_cb(int fd, short what, void *data)
 {
 	struct yawmd *ctx = data;
 
+	if (ctx->pipe != NULL)
+		pthread_mutex_lock(&ctx->pipe->socket_mutex);
 	nl_recvmsgs_default(ctx->socket);
+	if (ctx->pipe != NULL)
+		pthread_mutex_unlock(&ctx->pipe->socket_mutex);
+
+	if (ctx->pipeline && ctx->pipe->ingest_pending) {
+		ctx->pipe->ingest_pending = false;
+		pipeline_notify(ctx->pipe->ingest_efd);
+	}
 }
 
 /* Setup netlink socket and callbacks. */
@@ -924,7 +1432,7 @@ static void print_help(int exval)
 {
 	printf("yawmd (version %d.%d) - a wireless medium simulator\n",
 	       YAWMD_VERSION_MAJOR, YAWMD_VERSION_MINOR);
-	printf("yawmd [-h] [-V] [-s] [-l LOG_LVL] [-x FILE] -c FILE\n\n");
+	printf("yawmd [-h] [-V] [-s] [-t | -p | -r TRACE] [-l LOG_LVL] [-x FILE] -c FILE\n\n");
 
 	printf("  -h              print this help and exit\n");
 	printf("  -V              print version and exit\n\n");
@@ -937,6 +1445,13 @@ static void print_help(int exval)
 	printf("                  == 7: all packets will be logged\n");
 	printf("  -c FILE         set input config file\n");
 	printf("  -t              simulate mediums in different threads\n");
+	printf("  -p              pipelined mode: receive, simulate and send\n");
+	printf("                  in three different threads (not with -t)\n");
+	printf("  -r TRACE        replay the transmissions of TRACE in virtual\n");
+	printf("                  time, as fast as possible, instead of using\n");
+	printf("                  mac80211_hwsim (not with -t or -p)\n");
+	printf("\n  SIGUSR1 prints the counters of each medium (frames, queue\n");
+	printf("  depth, delivery lateness).\n");
 	// printf("  -x FILE         set input PER file\n");
 	// printf("  -s              start the server on a socket\n");
 	// printf("  -d              use the dynamic complex mode\n");
@@ -945,99 +1460,322 @@ static void print_help(int exval)
 	exit(exval);
 }
 
-static void movement_timer_cb(int fd, short what, void *data) {
+//------------------------------------------------------------------------------
+/* Mobility worker, see struct mobility */
+
+static void *mobility_main(void *arg)
+{
+	struct medium *medium = arg;
+	struct mobility *mob = medium->mobility;
+	unsigned int ticks;
+
+	pthread_mutex_lock(&mob->mutex);
+	for (;;) {
+		// Wait until the previous matrix was published.
+		while (mob->ticks == 0 || mob->ready)
+			pthread_cond_wait(&mob->cond, &mob->mutex);
+		ticks = mob->ticks;
+		mob->ticks = 0;
+		pthread_mutex_unlock(&mob->mutex);
+
+		// Movements requested while the previous one was being
+		// calculated are applied at once.
+		while (ticks-- > 0)
+			medium->move_interfaces(medium);
+		recalc_path_loss(medium, mob->shadow, mob->shadow_lists,
+				 &mob->shadow_gen);
+
+		pthread_mutex_lock(&mob->mutex);
+		mob->ready = true;
+		pipeline_notify(mob->efd);
+	}
+	return NULL;
+}
+
+/* Runs in the event loop of the medium, which is the only reader of
+.snr_matrix. */
+static void mobility_publish_cb(int fd, short what, void *data)
+{
 	struct medium *medium = data;
+	struct mobility *mob = medium->mobility;
+	struct snr_lists *old_lists;
 	uint64_t u;
+	void *old;
+	u32 gen;
 
 	read(fd, &u, sizeof(u));
 
-	//printf("movement_timer_cb for medium id=%d\n", medium->id);
+	pthread_mutex_lock(&mob->mutex);
+	if (mob->ready) {
+		if (medium->compact_matrix) {
+			old = medium->snr_matrix16;
+			medium->snr_matrix16 = mob->shadow;
+		} else {
+			old = medium->snr_matrix;
+			medium->snr_matrix = mob->shadow;
+		}
+		mob->shadow = old;
+		old_lists = medium->snr_lists;
+		medium->snr_lists = mob->shadow_lists;
+		mob->shadow_lists = old_lists;
+		gen = medium->snr_gen;
+		medium->snr_gen = mob->shadow_gen;
+		mob->shadow_gen = gen;
+		mob->ready = false;
+		if (medium->snr_gen != gen)
+			medium->link_epoch++;
+		pthread_cond_signal(&mob->cond);
+	}
+	pthread_mutex_unlock(&mob->mutex);
+}
 
-	medium->move_interfaces(medium);
-	timespec_add_seconds(&medium->move_time.it_value, medium->move_interval);
-	timerfd_settime(medium->move_timerfd, TFD_TIMER_ABSTIME,
-			&medium->move_time, NULL);
+/* Start the mobility worker of the medium. On failure the SNRs keep being
+recalculated in the event loop. */
+static void init_mobility(struct medium *medium, struct event_base *ev_base)
+{
+	struct mobility *mob = calloc(1, sizeof(struct mobility));
+	size_t size = (medium->compact_matrix ? sizeof(s16) : sizeof(int)) *
+		      medium->n_interfaces * medium->n_interfaces;
+
+	if (mob == NULL)
+		goto fail;
+	mob->efd = eventfd(0, EFD_NONBLOCK);
+	if (mob->efd < 0)
+		goto fail;
+	if (medium->snr_lists != NULL) {
+		mob->shadow_lists = snr_lists_dup(medium->snr_lists,
+						  medium->n_interfaces);
+		if (mob->shadow_lists == NULL)
+			goto fail;
+	} else {
+		mob->shadow = malloc(size);
+		if (mob->shadow == NULL)
+			goto fail;
+		memcpy(mob->shadow, snr_matrix_of(medium), size);
+	}
+	mob->shadow_gen = medium->snr_gen;
+	pthread_mutex_init(&mob->mutex, NULL);
+	pthread_cond_init(&mob->cond, NULL);
+	event_assign(&mob->publish_event, ev_base, mob->efd,
+		     EV_READ | EV_PERSIST, mobility_publish_cb, medium);
+	event_add(&mob->publish_event, NULL);
+
+	medium->mobility = mob;
+	if (pthread_create(&mob->thread, NULL, mobility_main, medium) == 0)
+		return;
+	event_del(&mob->publish_event);
+	medium->mobility = NULL;
+fail:
+	w_flogf(medium->ctx, LOG_WARNING, stderr, "Unable to start the "
+		"mobility worker of medium %d\n", medium->id);
+	if (mob != NULL) {
+		if (mob->efd >= 0)
+			close(mob->efd);
+		free(mob->shadow);
+		snr_lists_free(mob->shadow_lists);
+		free(mob);
+	}
+}
+
+/* Move the interfaces of the medium one step. */
+static void move_medium(struct medium *medium)
+{
+	struct mobility *mob = medium->mobility;
+
+	if (mob == NULL) {
+		u32 gen = medium->snr_gen;
+
+		medium->move_interfaces(medium);
+		recalc_path_loss(medium, snr_matrix_of(medium),
+				 medium->snr_lists, &medium->snr_gen);
+		if (medium->snr_gen != gen)
+			medium->link_epoch++;
+	} else {
+		pthread_mutex_lock(&mob->mutex);
+		mob->ticks++;
+		pthread_cond_signal(&mob->cond);
+		pthread_mutex_unlock(&mob->mutex);
+	}
 	//dump_medium_info(medium);
-	return;
 }
 
-static void delivery_timer_cb(int fd, short what, void *data)
+/* Move all the mediums that are due at the current tick of the mobility clock
+and set the timer for the next tick. */
+static void mobility_tick(struct yawmd *ctx)
 {
+	struct mobility_clock *mclock = &ctx->mclock;
+	struct medium *m;
+
+	list_for_each_entry(m, &ctx->medium_list, list)
+		if (m->move_interfaces != NULL &&
+		    mclock->count % m->move_ticks == 0)
+			move_medium(m);
+	mclock->count++;
+
+	timespec_add_seconds(&mclock->next.it_value,
+			     mclock->tick / ctx->time_dilation);
+	set_mobility_timer(ctx);
+}
+
+static void mobility_timer_cb(int fd, short what, void *data)
+{
+	uint64_t u;
+
+	read(fd, &u, sizeof(u));
+
+	mobility_tick(data);
+}
+
+/* Own movement timer of a medium, with one thread per medium. */
+static void movement_timer_cb(int fd, short what, void *data) {
 	struct medium *medium = data;
+	struct yawmd *ctx = medium->ctx;
 	uint64_t u;
 
 	read(fd, &u, sizeof(u));
 
-	deliver_queued_frames(medium);
+	//printf("movement_timer_cb for medium id=%d\n", medium->id);
+
+	move_medium(medium);
+	timespec_add_seconds(&medium->move_time.it_value,
+			     medium->move_ticks * ctx->mclock.tick /
+			     ctx->time_dilation);
+	set_move_timer(medium);
+	return;
 }
 
-/* Initialize event timers when running with only one thread */
-static void init_event_timers(struct yawmd *ctx) {
-	struct medium *m;
-	struct timespec now;
-	struct itimerspec it;
+static unsigned long gcd(unsigned long a, unsigned long b)
+{
+	while (b != 0) {
+		unsigned long t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	it.it_interval.tv_sec = 0;
-	it.it_interval.tv_nsec = 0;
-	// FIXME: 20sec delay before starting movement
-	// TODO: make it a configuration from the file?
-	it.it_value.tv_sec = now.tv_sec + 20;
-	it.it_value.tv_nsec = now.tv_nsec;
+/* Place the mediums that move on the grid of the mobility clock. If no tick
+is configured it is the greatest common divisor of the move_interval of the
+mediums, in milliseconds, so that no interval changes. Returns false if no
+medium moves. */
+static bool init_mobility_clock(struct yawmd *ctx)
+{
+	struct mobility_clock *mclock = &ctx->mclock;
+	struct timespec now;
+	unsigned long tick_ms = 0;
+	struct medium *m;
 
 	list_for_each_entry(m, &ctx->medium_list, list) {
-		m->delivery_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
-		event_assign(&m->delivery_event, ctx->ev_base,
-			     m->delivery_timerfd, EV_READ | EV_PERSIST,
-			     delivery_timer_cb, m);
-		event_add(&m->delivery_event, NULL);
+		if (m->move_interfaces == NULL)
+			continue;
+		long ms = lround(m->move_interval * 1000);
+		tick_ms = gcd(tick_ms, ms > 0 ? (unsigned long) ms : 1);
+	}
+	if (tick_ms == 0)
+		return false;
+	if (mclock->tick <= 0.0)
+		mclock->tick = tick_ms / 1000.0;
 
+	list_for_each_entry(m, &ctx->medium_list, list) {
 		if (m->move_interfaces == NULL)
 			continue;
-		m->move_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
-		event_assign(&m->move_event, ctx->ev_base, m->move_timerfd,
-			     EV_READ | EV_PERSIST, movement_timer_cb, m);
-		event_add(&m->move_event, NULL);
-		timerfd_settime(m->move_timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-		m->move_time = it;
+		long ticks = lround(m->move_interval / mclock->tick);
+		m->move_ticks = ticks > 0 ? (unsigned int) ticks : 1;
+		if (fabs(m->move_ticks * mclock->tick - m->move_interval) >
+		    1E-9) {
+			w_flogf(ctx, LOG_WARNING, stderr, "move_interval of "
+				"medium %d rounded to %f s (%u ticks)\n",
+				m->id, m->move_ticks * mclock->tick,
+				m->move_ticks);
+			m->move_interval = m->move_ticks * mclock->tick;
+		}
 	}
-	return;
+
+	sim_clock_now(ctx, &now);
+	mclock->count = 0;
+	mclock->next.it_interval.tv_sec = 0;
+	mclock->next.it_interval.tv_nsec = 0;
+	mclock->next.it_value = now;
+	timespec_add_seconds(&mclock->next.it_value,
+			     mclock->start_delay / ctx->time_dilation);
+	w_logf(ctx, LOG_NOTICE, "Mobility tick %f s, first movement in %f s\n",
+	       mclock->tick, mclock->start_delay);
+	return true;
+}
+
+static void delivery_timer_cb(int fd, short what, void *data)
+{
+	struct channel *channel = data;
+	uint64_t u;
+
+	read(fd, &u, sizeof(u));
+
+	deliver_queued_frames(channel);
+}
+
+/* Start the mobility worker of a medium and select the event loop of the
+delivery timers of its channels, which are created with the channels (see
+get_channel()). With one thread per medium it also sets the own movement timer
+of the medium. In virtual time mode ev_base is not used, the timers are events
+of ctx->vevents. */
+static void init_medium_timers(struct medium *medium,
+			       struct event_base *ev_base)
+{
+	struct yawmd *ctx = medium->ctx;
+
+	medium->ev_base = ev_base;
+
+	if (medium->move_interfaces == NULL || ctx->virtual_time)
+		// In virtual time the positions must change exactly at the
+		// time of the movement event, so they are not recalculated in
+		// the background.
+		return;
+
+	// with model.lazy_links a movement is only O(n)
+	if (!medium->lazy_links)
+		init_mobility(medium, ev_base);
+	if (!ctx->threads)
+		return;
+
+	medium->move_time = ctx->mclock.next;
+	medium->move_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	event_assign(&medium->move_event, ev_base, medium->move_timerfd,
+		     EV_READ | EV_PERSIST, movement_timer_cb, medium);
+	event_add(&medium->move_event, NULL);
+	set_move_timer(medium);
+}
+
+/* Initialize event timers of all mediums in the same event loop. Used when
+running with only one thread, by the simulation thread of the pipeline and in
+virtual time mode. */
+static void init_event_timers(struct yawmd *ctx, struct event_base *ev_base)
+{
+	struct medium *m;
+
+	list_for_each_entry(m, &ctx->medium_list, list)
+		init_medium_timers(m, ev_base);
+
+	if (!init_mobility_clock(ctx))
+		return;
+	if (!ctx->virtual_time) {
+		ctx->mclock.timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+		event_assign(&ctx->mclock.event, ev_base, ctx->mclock.timerfd,
+			     EV_READ | EV_PERSIST, mobility_timer_cb, ctx);
+		event_add(&ctx->mclock.event, NULL);
+	}
+	set_mobility_timer(ctx);
 }
 
 /* Initialize event timers when running with multiple threads. */
 static void init_threads_event_timers(struct medium *medium,
 				      struct event_base *ev_base)
 {
-	struct timespec now;
-	struct itimerspec it;
-
 	medium->queue_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
 	event_assign(&medium->queue_event, ev_base, medium->queue_timerfd,
 		     EV_READ | EV_PERSIST, thread_queue_frame, medium);
 	event_add(&medium->queue_event, NULL);
 
-	medium->delivery_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
-	event_assign(&medium->delivery_event, ev_base,
-		     medium->delivery_timerfd, EV_READ | EV_PERSIST,
-		     delivery_timer_cb, medium);
-	event_add(&medium->delivery_event, NULL);
-
-	if (medium->move_interfaces != NULL) {
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		it.it_interval.tv_sec = 0;
-		it.it_interval.tv_nsec = 0;
-		// FIXME: 20sec delay before starting move
-		// TODO: make it a configuration from the file?
-		it.it_value.tv_sec = now.tv_sec + 20;
-		it.it_value.tv_nsec = now.tv_nsec;
-		medium->move_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
-		event_assign(&medium->move_event, ev_base, medium->move_timerfd,
-			     EV_READ | EV_PERSIST, movement_timer_cb, medium);
-		event_add(&medium->move_event, NULL);
-		timerfd_settime(medium->move_timerfd, TFD_TIMER_ABSTIME, &it,
-				NULL);
-		medium->move_time = it;
-	}
+	init_medium_timers(medium, ev_base);
 }
 
 void *thread_main(void *arg)
@@ -1064,12 +1802,265 @@ void *thread_main(void *arg)
 	return NULL;
 }
 
+/* Print the counters of every medium. */
+static void dump_medium_stats(struct yawmd *ctx, FILE *stream)
+{
+	struct medium *m;
+
+	list_for_each_entry(m, &ctx->medium_list, list) {
+		struct medium_stats *st = &m->stats;
+		fprintf(stream, "medium %d: frames in %lu, delivered %lu, "
+			"rejected (overload) %lu, queued %u (max %u), "
+			"lateness %ld us (max %ld us)%s\n", m->id,
+			st->frames_in, st->frames_delivered,
+			st->frames_overload, st->queue_depth,
+			st->max_queue_depth, st->lateness_usec,
+			st->max_lateness_usec,
+			m->overload.overloaded ? ", overloaded" : "");
+		if (m->per_cache != NULL)
+			fprintf(stream, "medium %d: PER cache hits %lu, "
+				"misses %lu\n", m->id, m->per_cache->hits,
+				m->per_cache->misses);
+		if (m->link_cache != NULL)
+			fprintf(stream, "medium %d: link cache hits %lu, "
+				"misses %lu\n", m->id, st->link_cache_hits,
+				st->link_cache_misses);
+	}
+}
+
+static void stats_signal_cb(evutil_socket_t sig, short what, void *data)
+{
+	dump_medium_stats(data, stdout);
+}
+
+/* Make the time dilation factor available to the tools running in the host,
+which need it to scale their own timings (e.g. traffic generators).
+mac80211_hwsim has no attribute for it, this file is its only way out. */
+static bool write_time_dilation_file(struct yawmd *ctx)
+{
+	FILE *file;
+
+	if (ctx->time_dilation_file == NULL)
+		return true;
+
+	file = fopen(ctx->time_dilation_file, "w");
+	if (file == NULL) {
+		w_flogf(ctx, LOG_ERR, stderr, "Cannot write %s: %s\n",
+			ctx->time_dilation_file, strerror(errno));
+		return false;
+	}
+	fprintf(file, "%f\n", ctx->time_dilation);
+	fclose(file);
+	return true;
+}
+
+/* Simulation stage: queue the frames decoded by the ingest stage. */
+static void pipeline_ingest_cb(int fd, short what, void *data)
+{
+	struct yawmd *ctx = data;
+	struct frame *frame;
+	uint64_t u;
+
+	read(fd, &u, sizeof(u));
+
+	for (unsigned int i = 0; i < PIPELINE_BATCH; i++) {
+		frame = spsc_ring_pop(&ctx->pipe->ingest);
+		if (frame == NULL)
+			return;
+		queue_frame(frame);
+	}
+
+	// The ring is not empty. Make libevent call again, but allow the
+	// delivery timers to run in between.
+	pipeline_notify(fd);
+}
+
+void *pipeline_sim_main(void *arg)
+{
+	struct yawmd *ctx = arg;
+	struct pipeline *pipe = ctx->pipe;
+
+	event_assign(&pipe->ingest_event, pipe->sim_base, pipe->ingest_efd,
+		     EV_READ | EV_PERSIST, pipeline_ingest_cb, ctx);
+	event_add(&pipe->ingest_event, NULL);
+	init_event_timers(ctx, pipe->sim_base);
+
+	event_base_dispatch(pipe->sim_base);
+
+	event_base_free(pipe->sim_base);
+	return NULL;
+}
+
+/* Egress stage: send the reception information of the delivered frames. The
+socket is shared with the main thread, see pipeline.socket_mutex. */
+void *pipeline_egress_main(void *arg)
+{
+	struct yawmd *ctx = arg;
+	struct frame *frame;
+	uint64_t u;
+
+	for (;;) {
+		if (read(ctx->pipe->egress_efd, &u, sizeof(u)) < 0 &&
+		    errno != EINTR)
+			break;
+
+		while ((frame = spsc_ring_pop(&ctx->pipe->egress)) != NULL) {
+			pthread_mutex_lock(&ctx->pipe->socket_mutex);
+			ctx->send_rx_info(ctx, frame, frame->rx_rate_idx,
+					  &frame->recv_info);
+			pthread_mutex_unlock(&ctx->pipe->socket_mutex);
+			delete_container(&frame->recv_info);
+			free(frame);
+		}
+	}
+
+	w_flogf(ctx, LOG_ERR, stderr, "Pipeline egress stopped: %s\n",
+		strerror(errno));
+	return NULL;
+}
+
+/* Allocate the rings and start the simulation and egress threads. */
+static int init_pipeline(struct yawmd *ctx)
+{
+	struct pipeline *pipe;
+
+	pipe = aligned_alloc(SPSC_RING_CACHELINE, sizeof(struct pipeline));
+	if (pipe == NULL)
+		return -1;
+	memset(pipe, 0, sizeof(struct pipeline));
+	ctx->pipe = pipe;
+
+	if (!spsc_ring_init(&pipe->ingest, PIPELINE_RING_SIZE) ||
+	    !spsc_ring_init(&pipe->egress, PIPELINE_RING_SIZE)) {
+		w_logf(ctx, LOG_ERR, "Error allocating pipeline rings\n");
+		return -1;
+	}
+
+	pipe->ingest_efd = eventfd(0, 0);
+	pipe->egress_efd = eventfd(0, 0);
+	if (pipe->ingest_efd < 0 || pipe->egress_efd < 0) {
+		w_logf(ctx, LOG_ERR, "Error creating pipeline eventfd: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+
+	pipe->sim_base = event_base_new();
+	if (pipe->sim_base == NULL) {
+		w_logf(ctx, LOG_ERR, "Error creating pipeline event_base\n");
+		return -1;
+	}
+	pthread_mutex_init(&pipe->socket_mutex, NULL);
+
+	if (pthread_create(&pipe->egress_thread, NULL, pipeline_egress_main,
+			   ctx) != 0 ||
+	    pthread_create(&pipe->sim_thread, NULL, pipeline_sim_main,
+			   ctx) != 0) {
+		w_logf(ctx, LOG_ERR, "Error creating pipeline threads\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Virtual time replacement of send_rx_info_nl(): one line per frame. */
+static int send_rx_info_trace(struct yawmd *ctx, struct frame *frame,
+			      u32 rate_idx, struct recv_container *recv_info)
+{
+	printf(TIME_FMT " %llu " MAC_FMT " %s %u %d\n", TIME_ARGS(&ctx->vnow),
+	       (unsigned long long) frame->cookie,
+	       MAC_ARGS(frame->sender->addr),
+	       (frame->flags & HWSIM_TX_STAT_ACK) ? "ack" : "noack",
+	       rate_idx, recv_info->size);
+	return 0;
+}
+
+/* Read the next transmission of the trace and schedule it. Returns false at
+the end of the trace. */
+static bool schedule_next_trace_frame(struct yawmd *ctx)
+{
+	struct trace_record rec;
+	struct interface *sender;
+	struct frame *frame;
+
+	while (trace_next(ctx->trace, &rec)) {
+		sender = get_interface(ctx, rec.transmitter);
+		if (sender == NULL) {
+			w_flogf(ctx, LOG_ERR, stderr, "Unable to find sender "
+				"station " MAC_FMT " (%s:%u)\n",
+				MAC_ARGS(rec.transmitter), ctx->trace->name,
+				ctx->trace->line);
+			continue;
+		}
+		memcpy(sender->hwaddr, sender->addr, ETH_ALEN);
+
+		frame = calloc(1, sizeof(struct frame));
+		if (frame == NULL)
+			return false;
+		frame->header.frame_control[0] = rec.frame_control;
+		memcpy(frame->header.addr1, rec.receiver, ETH_ALEN);
+		memcpy(frame->header.addr2, rec.transmitter, ETH_ALEN);
+		if (rec.tid >= 0)
+			*frame_get_qos_ctl(frame) = (u8) rec.tid;
+		frame->frame_len = rec.frame_len;
+		frame->flags = rec.flags;
+		frame->cookie = ctx->trace->line;
+		frame->freq = rec.freq;
+		frame->sender = sender;
+		sender->frequency = rec.freq;
+		frame->tx_rates_count = rec.tx_rates_count;
+		memcpy(frame->tx_rates, rec.tx_rates, sizeof(frame->tx_rates));
+		memcpy(frame->tx_rate_flags, rec.tx_rate_flags,
+		       sizeof(frame->tx_rate_flags));
+
+		vevent_schedule(ctx->vevents, rec.time, VEVENT_INGEST, frame);
+		ctx->vframes++;
+		return true;
+	}
+	return false;
+}
+
+/* Virtual time main loop. Processes the events in order, jumping the clock to
+each one, until the trace ends and every frame was delivered. */
+static int run_virtual_time(struct yawmd *ctx)
+{
+	struct vevent ev;
+	bool trace_done;
+
+	init_event_timers(ctx, NULL);
+	trace_done = !schedule_next_trace_frame(ctx);
+
+	printf("# time cookie transmitter status rate_idx receivers\n");
+	while (vevent_next(ctx->vevents, &ev)) {
+		ns_to_timespec(ev.time, &ctx->vnow);
+		switch (ev.type) {
+		case VEVENT_INGEST:
+			ctx->vframes--;
+			queue_frame(ev.data);
+			if (!trace_done)
+				trace_done = !schedule_next_trace_frame(ctx);
+			break;
+		case VEVENT_DELIVERY:
+			ctx->vframes--;
+			deliver_queued_frames(ev.data);
+			break;
+		case VEVENT_MOVE:
+			// Movement alone would never end the simulation.
+			if (trace_done && ctx->vframes == 0)
+				break;
+			mobility_tick(ctx);
+			break;
+		}
+	}
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int opt;
 	struct event ev_cmd;
+	struct event ev_stats;
 	struct yawmd ctx;
 	char *config_file = NULL;
+	char *trace_file = NULL;
 	// char *per_file = NULL;
 
 	setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
@@ -1085,9 +2076,16 @@ int main(int argc, char *argv[])
 	// bool start_server = false;
 	// bool full_dynamic = false;
 	ctx.threads = false;
+	ctx.pipeline = false;
+	ctx.pipe = NULL;
+	ctx.virtual_time = false;
+	ctx.vevents = NULL;
+	ctx.trace = NULL;
+	ctx.vframes = 0;
+	ctx.send_rx_info = send_rx_info_nl;
 
 	//while ((opt = getopt(argc, argv, ":hVc:l:x:sd:t")) != -1) {
-	while ((opt = getopt(argc, argv, ":hVc:l:t")) != -1) {
+	while ((opt = getopt(argc, argv, ":hVc:l:tpr:")) != -1) {
 		switch (opt) {
 		case 'h':
 			print_help(EXIT_SUCCESS);
@@ -1130,6 +2128,13 @@ int main(int argc, char *argv[])
 		case 't':
 			ctx.threads = true;
 			break;
+		case 'p':
+			ctx.pipeline = true;
+			break;
+		case 'r':
+			trace_file = optarg;
+			ctx.virtual_time = true;
+			break;
 		case '?':
 			printf("yawmd: Error - No such option: "
 			       "`%c'\n\n", optopt);
@@ -1142,6 +2147,11 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		print_help(EXIT_FAILURE);
 
+	if (ctx.threads + ctx.pipeline + ctx.virtual_time > 1) {
+		printf("yawmd: Error - Options -t, -p and -r are exclusive\n\n");
+		print_help(EXIT_FAILURE);
+	}
+
 	// if (full_dynamic) {
 	// 	if (config_file) {
 	// 		printf("%s: cannot use dynamic complex mode with config file\n", argv[0]);
@@ -1164,8 +2174,55 @@ int main(int argc, char *argv[])
 	//}
 
 	INIT_LIST_HEAD(&ctx.medium_list);
+	// before configure(), which computes the PHY timing of the mediums
+	init_per_tables();
+	init_rng_tables();
 	if (!configure(config_file, &ctx))
 		return EXIT_FAILURE;
+	w_logf(&ctx, LOG_NOTICE, "Random seed: %llu\n",
+	       (unsigned long long) ctx.seed);
+	if (ctx.per_file != NULL) {
+		if (!load_per_file(ctx.per_file))
+			return EXIT_FAILURE;
+		w_logf(&ctx, LOG_NOTICE, "PER table %s\n", ctx.per_file);
+	}
+
+	if (ctx.virtual_time && ctx.time_dilation != 1.0) {
+		w_logf(&ctx, LOG_NOTICE, "Time dilation ignored in virtual time "
+		       "mode\n");
+		ctx.time_dilation = 1.0;
+	}
+	if (ctx.time_dilation != 1.0) {
+		w_logf(&ctx, LOG_NOTICE, "Time dilation factor: %g (1 s of "
+		       "simulation takes %g s)\n", ctx.time_dilation,
+		       1.0 / ctx.time_dilation);
+		if (!write_time_dilation_file(&ctx))
+			return EXIT_FAILURE;
+	}
+
+	if (ctx.virtual_time) {
+		struct vevent_queue vevents;
+
+		w_logf(&ctx, LOG_NOTICE, "Replaying trace %s in virtual time\n",
+		       trace_file);
+		ctx.trace = trace_open(trace_file);
+		if (ctx.trace == NULL || !vevent_queue_init(&vevents))
+			return EXIT_FAILURE;
+		ctx.vevents = &vevents;
+		ctx.vnow.tv_sec = 0;
+		ctx.vnow.tv_nsec = 0;
+		ctx.send_rx_info = send_rx_info_trace;
+
+		run_virtual_time(&ctx);
+		dump_medium_stats(&ctx, stderr);
+
+		vevent_queue_free(&vevents);
+		trace_close(ctx.trace);
+		delete_mediums(&ctx);
+		pool_free(ctx.path_loss_pool);
+		free(ctx.time_dilation_file);
+		return EXIT_SUCCESS;
+	}
 
 	// This will be used to set the timers that signals medium.queue_event
 	// that a new frame for processing is available at medium.frame_queue.
@@ -1195,9 +2252,19 @@ int main(int argc, char *argv[])
 		     EV_READ | EV_PERSIST, sock_event_cb, &ctx);
 	event_add(&ev_cmd, NULL);
 
+	event_assign(&ev_stats, ctx.ev_base, SIGUSR1, EV_SIGNAL | EV_PERSIST,
+		     stats_signal_cb, &ctx);
+	event_add(&ev_stats, NULL);
+
 	/* setup timers */
-	if (ctx.threads) {
+	if (ctx.pipeline) {
+		if (init_pipeline(&ctx) < 0)
+			return EXIT_FAILURE;
+	}
+	else if (ctx.threads) {
 	struct medium *m;
+		// Each thread aligns its movement timer to the ticks.
+		init_mobility_clock(&ctx);
 		list_for_each_entry(m, &ctx.medium_list, list) {
 			if (pthread_create(&m->thread, NULL, thread_main, m) != 0) {
 				printf("Error creating thread for medium id %d\n",
@@ -1207,7 +2274,7 @@ int main(int argc, char *argv[])
 		}
 	}
 	else {
-		init_event_timers(&ctx);
+		init_event_timers(&ctx, ctx.ev_base);
 	}
 
 	/* register for new frames */
@@ -1239,6 +2306,8 @@ int main(int argc, char *argv[])
 	// free(ctx.per_matrix);
 	
 	delete_mediums(&ctx);
+	pool_free(ctx.path_loss_pool);
+	free(ctx.time_dilation_file);
 
 	return EXIT_SUCCESS;
 }
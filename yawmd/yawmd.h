@@ -43,11 +43,55 @@
 #include <pthread.h>
 #include "list.h"
 #include "ieee80211.h"
+#include "ring.h"
+#include "rng.h"
+#include "pool.h"
 
 #define HWSIM_TX_CTL_REQ_TX_STATUS	1
 #define HWSIM_TX_CTL_NO_ACK		(1 << 1)
 #define HWSIM_TX_STAT_ACK		(1 << 2)
 
+/* enum mac80211_rate_control_flags of HWSIM_ATTR_TX_INFO_FLAGS */
+#define HWSIM_TX_RC_MCS			(1 << 3)
+#define HWSIM_TX_RC_40_MHZ_WIDTH	(1 << 5)
+#define HWSIM_TX_RC_SHORT_GI		(1 << 7)
+#define HWSIM_TX_RC_VHT_MCS		(1 << 8)
+#define HWSIM_TX_RC_80_MHZ_WIDTH	(1 << 9)
+#define HWSIM_TX_RC_160_MHZ_WIDTH	(1 << 10)
+/* Not sent by mac80211_hwsim, HE rates of traces only (see vtime.h). */
+#define HWSIM_TX_RC_HE_MCS		(1 << 11)
+#define HWSIM_TX_RC_HE_GI_1_6		(1 << 12)
+#define HWSIM_TX_RC_HE_GI_3_2		(1 << 13)
+
+enum rate_mode {
+	RATE_MODE_LEGACY,
+	RATE_MODE_HT,
+	RATE_MODE_VHT,
+	RATE_MODE_HE,
+};
+
+enum rate_bw {
+	RATE_BW_20,
+	RATE_BW_40,
+	RATE_BW_80,
+	RATE_BW_160,
+};
+
+/*
+ * Rate of a transmission as used by the error and duration models: the PHY,
+ * MCS, spatial streams, bandwidth and guard interval (0 long, 1 short for
+ * HT/VHT; 0 0.8 us, 1 1.6 us, 2 3.2 us for HE). The code of a legacy rate is
+ * its mac80211_hwsim rate index. See hwsim_rate_code().
+ */
+#define RATE_CODE(mode, mcs, nss, bw, gi) \
+	((u32) (mode) << 12 | (u32) (bw) << 10 | (u32) (gi) << 8 | \
+	 (u32) ((nss) - 1) << 4 | (u32) (mcs))
+#define RATE_MODE(code)	(((code) >> 12) & 0x3)
+#define RATE_BW(code)	(((code) >> 10) & 0x3)
+#define RATE_GI(code)	(((code) >> 8) & 0x3)
+#define RATE_NSS(code)	((((code) >> 4) & 0x7) + 1)
+#define RATE_MCS(code)	((code) & 0xf)
+
 /* Netlink message identifier */
 enum {
 	HWSIM_CMD_UNSPEC,
@@ -155,6 +199,8 @@ enum {
 
 
 typedef uint8_t u8;
+typedef int16_t s16;
+typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
@@ -166,6 +212,53 @@ struct wqueue {
 };
 
 
+/* Size of each of the rings connecting the pipeline stages (power of 2). */
+#define PIPELINE_RING_SIZE	4096
+/* Maximum number of elements a pipeline stage takes from its ring before
+yielding to the other events of its loop. */
+#define PIPELINE_BATCH		64
+
+/* Pipelined mode (-p). The main thread receives the netlink messages and
+decodes HWSIM_YAWMD_TX_INFO (ingest), a simulation thread runs queue_frame() and
+the delivery and movement timers of all mediums, and an egress thread builds and
+sends HWSIM_YAWMD_RX_INFO. The stages exchange struct frame pointers. */
+struct pipeline {
+	// ingest -> simulation
+	struct spsc_ring	ingest;
+	int			ingest_efd;
+	bool			ingest_pending;
+	// simulation -> egress
+	struct spsc_ring	egress;
+	int			egress_efd;
+	pthread_t		sim_thread;
+	pthread_t		egress_thread;
+	// yawmd.socket is shared by the main thread, which receives and
+	// registers, and the egress thread, which sends; libnl sockets are not
+	// thread safe
+	pthread_mutex_t		socket_mutex;
+	struct event_base	*sim_base;
+	struct event		ingest_event;
+};
+
+struct frame;
+struct recv_container;
+struct vevent_queue;
+struct trace;
+struct mobility_trace;
+
+/* Movement of all the mediums on a common grid of ticks: every tick the
+mediums that are due are moved in one pass. A medium moves every
+medium.move_ticks ticks. */
+struct mobility_clock {
+	double			tick;		// seconds, 0 to derive it from
+						// the move_interval of mediums
+	double			start_delay;	// seconds until the first tick
+	unsigned long		count;		// ticks elapsed
+	struct itimerspec	next;		// time of the next tick
+	int			timerfd;
+	struct event		event;
+};
+
 /* General information regarding yawmd. */
 struct yawmd {
 	// list of struct medium
@@ -178,6 +271,250 @@ struct yawmd {
 	int			timer_fd;
 	struct event_base	*ev_base;
 	bool			threads;
+	bool			pipeline;
+	struct pipeline		*pipe;
+	// Virtual time mode (-r): the clock is .vnow, which only advances
+	// when the next event of .vevents is processed.
+	bool			virtual_time;
+	struct timespec		vnow;
+	struct vevent_queue	*vevents;
+	struct trace		*trace;
+	// number of ingest and delivery events in .vevents
+	unsigned long		vframes;
+	// Simulated seconds per real second. Frame durations and the movement
+	// interval are divided by it. 1.0 unless configured.
+	double			time_dilation;
+	// Optional file where the factor is written for the host tools.
+	char			*time_dilation_file;
+	struct mobility_clock	mclock;
+	// 0: no PER cache, 1: exact frame lengths, n: buckets of n bytes
+	unsigned int		per_cache_bucket;
+	// links cached per transmitter, 0: no link cache
+	unsigned int		link_cache;
+	// Optional binary PER table used instead of the analytical model.
+	char			*per_file;
+	// Draw the attempts of each rate of a frame at once instead of one
+	// by one, see sample_attempts().
+	bool			geometric_retries;
+	// Seed of the random streams of the mediums, from the clock unless
+	// configured.
+	u64			seed;
+	// Helper threads of recalc_path_loss(), NULL unless
+	// simulation.path_loss_threads is set.
+	unsigned int		path_loss_threads;
+	enum pool_schedule	path_loss_schedule;
+	struct pool		*path_loss_pool;
+	// Report the reception information of a delivered frame: to
+	// mac80211_hwsim, or to stdout in virtual time mode.
+	int	(*send_rx_info)	(struct yawmd *ctx, struct frame *frame,
+				 u32 rate_idx,
+				 struct recv_container *recv_info);
+};
+
+/* Scratch space for the receivers of a multicast frame, n_interfaces long,
+see deliver_multicast_batch(). */
+struct mcast_batch {
+	unsigned int		*itf;	// index of the receiver interface
+	// candidate receivers of the sender, only with model.lazy_links
+	unsigned int		*rx;
+	int			*snr;
+	double			*prob;
+	double			*rand;
+	bool			*lost;
+};
+
+
+/* SNR of the link from .tx to .rx computed on demand with model.lazy_links,
+see get_link_snr_lazy(). Valid while neither interface has changed since
+generation .gen, 0 if the slot is empty. */
+struct lazy_link {
+	u32			tx;
+	u32			rx;
+	u32			gen;
+	int			snr;
+};
+
+/* SNR of the link from a transmitter to receiver .rx, see link_cache_get().
+Valid while .epoch is the .link_epoch of the medium, 0 if the slot is empty. */
+struct link_cache_entry {
+	u32			rx;
+	u32			epoch;
+	int			snr;
+};
+
+#define PER_CACHE_BITS 8
+
+/* Frame error rates already computed, see get_error_prob_cached(). Owned by
+one medium, so it is only used by the thread that runs that medium. */
+struct per_cache {
+	unsigned int		bucket;	// bytes per length bucket
+	unsigned long		hits;
+	unsigned long		misses;
+	struct per_cache_entry {
+		u32		key;
+		double		per;
+	}			entries[1 << PER_CACHE_BITS];
+};
+
+/* Positions, gains and frequencies of the interfaces of a medium as arrays,
+the input of the path loss row kernels, see recalc_path_loss(). */
+struct itf_arrays {
+	double			*x, *y, *z;
+	int			*tx_gain;	// tx_power + antenna_gain
+	int			*rx_gain;	// antenna_gain
+	u32			*freq;
+	u32			gen;		// medium->itf_gen of the copy
+	// Scratch of recalc_path_loss(): the rows to recalculate, and the
+	// distances and path losses of one row per worker of the pool.
+	unsigned int		*rows;
+	double			*dist;
+	int			*path_loss;
+	// Scratch of the recalculation of struct snr_lists: the receivers of
+	// each recalculated row, and the recalculated transmitters to add to
+	// the list of each other interface.
+	unsigned int		*row_start;	// n_interfaces + 1, into .row_rx
+	unsigned int		*row_rx;
+	size_t			row_rx_size;
+	unsigned int		*add_start;	// n_interfaces + 1, into .add_tx
+	unsigned int		*add_tx;
+	size_t			add_tx_size;
+};
+
+/*
+ * Uniform grid over the x-y plane of a path_loss medium, model.spatial_grid.
+ * The cells are squares of side .range, the farthest distance at which a frame
+ * can be heard above DEFAULT_CCA_THRESHOLD, so an interface only hears those
+ * of its own cell and of the 8 around it. The cells are hashed into
+ * .n_buckets buckets, and the interfaces of a bucket are contiguous in .itf.
+ * Rebuilt from struct itf_arrays by recalc_path_loss().
+ */
+struct spatial_grid {
+	double			range;		// meters, INFINITY: no culling
+	// SNR of the pairs out of range; a frame is never heard at or below
+	// it, whatever the fading. Set with the model, read by the event loop.
+	int			unreachable_snr;
+	unsigned int		bits;		// n_buckets = 1 << bits
+	unsigned int		*start;		// n_buckets + 1, into .itf
+	unsigned int		*itf;		// the interfaces, by bucket
+	long long		*cx, *cy;	// cell of each interface
+	// scratch: the columns within range of one row per worker
+	unsigned int		*cols;
+};
+
+/* The receivers of every transmitter of a medium with their SNR, one list
+after the other (compressed sparse rows). */
+struct snr_rows {
+	unsigned int		*start;		// n_interfaces + 1, into .rx, .snr
+	unsigned int		*rx;		// ascending in each list
+	int			*snr;
+	size_t			capacity;	// of .rx and .snr
+};
+
+/*
+ * SNRs of a medium with few links for its number of interfaces, instead of the
+ * n^2 medium.snr_matrix. The pairs missing from the lists have .absent_snr.
+ * Chosen by the configuration of the medium, see use_snr_lists().
+ */
+struct snr_lists {
+	struct snr_rows		rows;
+	// the lists being rebuilt by recalc_path_loss(), swapped with .rows
+	struct snr_rows		spare;
+	int			absent_snr;
+	// .absent_snr is below DEFAULT_CCA_THRESHOLD whatever the fading, so
+	// only the receivers in its list hear a transmitter
+	bool			absent_unheard;
+};
+
+/* What to do with new frames while a medium is overloaded. */
+enum overload_policy {
+	// only log when the medium enters and leaves the overload state
+	OVERLOAD_LOG,
+	// frames of AC_BE and AC_BK are not transmitted and are reported
+	// immediately as not acked
+	OVERLOAD_DROP_BEST_EFFORT,
+	// every frame is reported immediately as not acked
+	OVERLOAD_NOT_ACKED,
+};
+
+/* A medium is overloaded when the frames are delivered later than
+.max_lateness_usec after their end of transmission, or when more than
+.max_queue frames wait in the QoS queues. 0 disables a threshold. */
+struct overload_control {
+	long			max_lateness_usec;
+	unsigned int		max_queue;
+	enum overload_policy	policy;
+	bool			overloaded;
+};
+
+/* MAC timing of a medium in microseconds. */
+struct phy_timing {
+	int			slot_time;
+	int			sifs;
+	int			difs;		// 2 * slot_time + sifs
+	// SIFS + ACK at the lowest rate of the band, 2.4 and 5 GHz
+	int			ack_time[2];
+};
+
+/* Counters of a medium. Updated by the thread simulating the medium and read
+without synchronization when they are dumped (SIGUSR1). */
+struct medium_stats {
+	unsigned long		frames_in;
+	unsigned long		frames_delivered;
+	// frames dropped or not acked because of overload
+	unsigned long		frames_overload;
+	unsigned int		queue_depth;
+	unsigned int		max_queue_depth;
+	// now - end of transmission, for the last frame delivered
+	long			lateness_usec;
+	long			max_lateness_usec;
+	unsigned long		link_cache_hits;
+	unsigned long		link_cache_misses;
+};
+
+/*
+ * Medium access state of one frequency of a medium. Frames on different
+ * frequencies of the same medium do not share airtime, so each frequency has
+ * its own queues and its own transmission in progress.
+ *
+ * It is stored the frame being transmitted at the moment
+ * (.current_transmission) and the timestamp at which it will end being
+ * transmitted (.end_transmission), which is also the time the
+ * .delivery_timerfd is set to trigger.
+ */
+struct channel {
+	struct list_head	list;
+	struct medium		*medium;
+	u32			freq;
+	int			delivery_timerfd;
+	struct event		delivery_event;
+	struct wqueue		qos_queues[IEEE80211_NUM_ACS];
+	struct frame		*current_transmission;
+	struct timespec		end_transmission;
+};
+
+/*
+ * Recalculation of the SNRs of a moving medium in a background thread, so
+ * that frame delivery never waits for the n^2 path loss calculation.
+ *
+ * The worker moves the interfaces and writes the SNRs into .shadow. The event
+ * loop of the medium is then woken up through .efd and swaps .shadow with
+ * medium->snr_matrix (or .shadow_lists with medium->snr_lists). Since the
+ * event loop is the only reader of the matrix, the matrix it gives back is no
+ * longer in use and the worker reuses it for the next movement.
+ */
+struct mobility {
+	pthread_t		thread;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	unsigned int		ticks;	// movements requested and not started
+	bool			ready;	// .shadow not yet published
+	// as medium.snr_matrix (or .snr_matrix16) and medium.snr_lists, only
+	// one is not NULL
+	void			*shadow;
+	struct snr_lists	*shadow_lists;
+	u32			shadow_gen;	// see medium.snr_gen
+	int			efd;
+	struct event		publish_event;
 };
 
 /* Each medium is an isolated transmission environment. */
@@ -190,30 +527,72 @@ struct medium {
 	int 			id;
 	unsigned 		n_interfaces;
 	struct interface 	*interfaces;
-	// row transmitter x column receiver
+	// row transmitter x column receiver, NULL if .snr_lists is used
 	int 			*snr_matrix;
+	// instead of .snr_matrix with model.compact_matrix, clamped to the
+	// range of s16
+	s16			*snr_matrix16;
+	// NULL unless the medium is large and sparse, see struct snr_lists
+	struct snr_lists	*snr_lists;
+	// Incremented by each movement that changes an interface.
+	// .snr_matrix holds the SNRs of the interfaces as of generation
+	// .snr_gen.
+	u32			itf_gen;
+	u32			snr_gen;
+	struct itf_arrays	itf_arrays;
+	// NULL unless model.spatial_grid
+	struct spatial_grid	*grid;
 	double 			*prob_matrix;
+	// instead of .prob_matrix with model.compact_matrix, fixed point with
+	// PROB_FIXED_SHIFT fractional bits
+	u16			*prob_matrix16;
+	// .snr_matrix16 or .prob_matrix16 is used
+	bool			compact_matrix;
+	// model.lazy_links: neither .snr_matrix nor .snr_lists, the SNR of a
+	// link is calculated when it is first used and kept in .lazy_cache
+	// (direct mapped, 1 << .lazy_bits slots)
+	bool			lazy_links;
+	struct lazy_link	*lazy_cache;
+	unsigned int		lazy_bits;
 	double 			move_interval;
+	unsigned int		move_ticks;	// see struct mobility_clock
+	// model.mobility_trace, played by move_interfaces() up to .trace_time
+	struct mobility_trace	*trace;
+	double			trace_time;
 	int 			fading_coefficient; // int??
 	int 			noise_level;
 	bool 			sim_interference;
 	int 			model_index; // enum model_name
-	int			move_timerfd;
-	int			delivery_timerfd;
 	int			queue_timerfd;
-	struct event		move_event;
-	struct event		delivery_event;
 	struct event		queue_event;
+	// Own movement timer, only with one thread per medium (-t). It is
+	// aligned with the ticks of yawmd.mclock.
+	int			move_timerfd;
+	struct event		move_event;
 	struct itimerspec 	move_time;
+	// event loop of the delivery timers of the channels
+	struct event_base	*ev_base;
 
-	// The medium stores information for medium access. It is stored the
-	// frame being transmitted at the moment (.current_transmission) and
-	// the timestamp at which it will end being transmitted
-	// (.end_transmission), which is also the time the .delivery_timerfd is
-	// set to trigger.
-	struct wqueue		qos_queues[IEEE80211_NUM_ACS];
-	struct frame		*current_transmission;
-	struct timespec		end_transmission;
+	// One struct channel per frequency used in the medium, created when
+	// the first frame on that frequency is queued.
+	struct list_head	channels;
+	// NULL when the SNRs are recalculated in the event loop
+	struct mobility		*mobility;
+	// NULL unless simulation.per_cache_bucket is set
+	struct per_cache	*per_cache;
+	// Incremented every time .snr_matrix changes. The row of a transmitter
+	// is allocated with its first unicast frame and has .link_cache_size
+	// slots, a power of 2. 0 without link cache.
+	u32			link_epoch;
+	unsigned int		link_cache_size;
+	struct link_cache_entry	**link_cache;
+	struct mcast_batch	mcast;
+	// random numbers of the simulation of this medium
+	struct rng		rng;
+
+	struct overload_control	overload;
+	struct phy_timing	phy;
+	struct medium_stats	stats;
 
 	union {
 		struct {
@@ -233,14 +612,29 @@ struct medium {
 	int 	(*get_link_snr)		(struct medium *medium,
 					 struct interface *transmitter,
 			    	 	 struct interface *receiver);
+	// rate is a rate code, see RATE_CODE()
 	double	(*get_error_prob)	(struct medium *medium, double snr,
-					 unsigned int rate_idx, u32 freq,
+					 u32 rate, u32 freq,
 					 int frame_len,
 					 struct interface *transmitter,
 					 struct interface *receiver);
+	// get_error_prob() of one transmission at n receivers with SNRs snr[],
+	// NULL if the model has no batch version
+	void	(*get_error_prob_batch)	(struct medium *medium, const int *snr,
+					 unsigned int n, u32 rate, u32 freq,
+					 int frame_len, double *prob);
 	int	(*path_loss_func)	(struct medium *medium,
 					 struct interface *transmitter,
 					 struct interface *receiver);
+	// path_loss_func() from the interface src to the n_cols interfaces
+	// cols[] (to every interface if cols is NULL), from .itf_arrays.
+	// dist is scratch, n_interfaces long.
+	void	(*path_loss_row)	(struct medium *medium,
+					 unsigned int src,
+					 const unsigned int *cols,
+					 unsigned int n_cols, double *dist,
+					 int *path_loss);
+	// moves the interfaces one step, see recalc_path_loss()
 	void	(*move_interfaces)	(struct medium *medium);
 };
 
@@ -255,6 +649,9 @@ struct interface
 	int 		antenna_gain;
 	int 		tx_power;
 	u32		frequency;
+	// medium->itf_gen of the last change of the position, tx_power or
+	// antenna_gain, see recalc_path_loss()
+	u32		changed;
 	struct medium	*medium;
 };
 
@@ -263,6 +660,32 @@ struct hwsim_tx_rate {
 	unsigned char count;
 };
 
+/* Element of HWSIM_ATTR_TX_INFO_FLAGS, HWSIM_TX_RC_* flags of a rate. */
+struct hwsim_tx_rate_flag {
+	signed char idx;
+	u16 flags;
+} __attribute__((__packed__));
+
+/* itf_recv_info - interface receive information
+
+One of the blocks of information sent to mac80211_hwsim to indicate which
+interfaces should receive a copy of the frame and with which signal
+intensity (as was determined by the simulation).
+Sent as an array of struct itf_recv_info. */
+struct itf_recv_info {
+ 	u8 mac_addr[ETH_ALEN];
+ 	u32 signal;
+} __attribute__((__packed__)) __attribute__((__aligned__(1)));
+
+
+/* Keeps track of the reception information of a frame. Instead of using
+directly itf_recv_info, the operations of adding the interface information
+are handled using procedures. */
+struct recv_container {
+	struct itf_recv_info *recv_info;
+	int size;
+};
+
 struct frame {
 	// list node
 	struct list_head	list;
@@ -275,10 +698,14 @@ struct frame {
 	int			tx_rates_count;
 	struct interface	*sender;
 	struct hwsim_tx_rate	tx_rates[IEEE80211_TX_MAX_RATES];
+	u16			tx_rate_flags[IEEE80211_TX_MAX_RATES];
 	// Frame length (MAC header + IP Header + Transport Header + Payload)
 	size_t			frame_len;
 	// Frame header. Includes space for QoS data.
 	struct ieee80211_hdr	header;
+	// Filled by deliver_frame() for the egress stage in pipelined mode.
+	u32			rx_rate_idx;
+	struct recv_container	recv_info;
 };
 
 struct log_distance_model_param {
@@ -312,28 +739,19 @@ struct intf_info {
 };
 
 
-/* itf_recv_info - interface receive information
-
-One of the blocks of information sent to mac80211_hwsim to indicate which
-interfaces should receive a copy of the frame and with which signal
-intensity (as was determined by the simulation).
-Sent as an array of struct itf_recv_info. */
-struct itf_recv_info {
- 	u8 mac_addr[ETH_ALEN];
- 	u32 signal;
-} __attribute__((__packed__)) __attribute__((__aligned__(1)));
-
-
-/* Keeps track of the reception information of a frame. Instead of using
-directly itf_recv_info, the operations of adding the interface information
-are handled using procedures. */
-struct recv_container {
-	struct itf_recv_info *recv_info;
-	int size;
-};
-
 int w_logf(struct yawmd *ctx, u8 level, const char *format, ...);
 int w_flogf(struct yawmd *ctx, u8 level, FILE *stream, const char *format, ...);
+void init_per_tables(void);
+bool load_per_file(const char *file_name);
+u32 hwsim_rate_code(signed char idx, u16 flags);
+int rate_duration(u32 rate, u32 freq, int frame_len);
+void get_error_prob_batch(const int *snr, unsigned int n, u32 rate, u32 freq,
+			  int frame_len, double *prob);
+void draw_losses_batch(const double *prob, const double *rand, bool *lost,
+		       unsigned int n);
+struct per_cache *per_cache_new(unsigned int bucket);
+double get_error_prob_cached(struct per_cache *cache, double snr, u32 rate,
+			     u32 freq, int frame_len);
 int index_to_rate(size_t index, u32 freq);
 
 #endif /* YAWMD_H_ */